@@ -40,12 +40,19 @@ MQ2Medley
 
 Usage:
 /medley name - Sing the given medley
-/medley queue "song/item/aa name" [-targetid|spawnid] [-interrupt] - add songs to queue to cast once
+/medley queue "song/item/aa name" [-targetid|spawnid] [-priority|high|normal|low] [-ttl|seconds] [-interrupt] - add songs to queue to cast once
 /medley stop/end/off - stop singing
 /medley - Resume the medley after using /medley stop
 /medley delay # - 10ths of a second, minimum of 0, default 3, how long after casting a spell to wait to cast next spell
 /medley reload - reload the INI file
 /medley quiet - Toggles songs listing for medley and queued songs
+/medley coordinate [on|off] [channel] - share song timers with other bards on this PC so they split the songs
+/medley stats [reset] - show scheduler state transition counters
+/medley immune [clear] - list or forget the immunities learned in this zone
+/medley burst "aa/item/song name" ["name" ...] [-interrupt] - fire instant AAs and clicks back to back, then resume the medley
+/medley group - show how much of the medley's group songs each group member has
+/medley analyze - report whether the medley can keep all its songs up
+/medley bench [iterations] - time the scheduler, expressions, chat matching and medley loading
 
 ----------------------------
 Item Click Method:
@@ -59,11 +66,13 @@ play medley defined in [MQ2Medley-melee] ini setion
 Interrupt current song and cast AA "Dirge of the Sleepwaler"
 /medley queue "Slumber of Silisia" -targetid|${Me.XTarget[2].ID}
 When current song ends, will mez XTarget[2] and switch back current target.
-Target will be switched for one pulse, which is typicaly less than 20ms
+Target is switched until the mez is seen starting to cast, at most 500ms
 /medley queue "Blade of Vesagran"
 Add epic click to queue
 /medley queue "Lesson of the Devoted"
 Lesson of the Devoted AA will be added to the twist queue and sung when current song finished
+/medley queue "Slumber of Silisia" -targetid|${Me.XTarget[3].ID} -priority|high -ttl|6
+Mez XTarget[3] ahead of normal priority queued songs, drop it if it could not start within 6 seconds
 
 ----------------------------
 MQ2Data TLO Variables:
@@ -77,11 +86,36 @@ Medley.Tune
 - int 0 Always 0 since changed to "A Tune Stuck in My Head" AA
 Medley.Active
 - boolean true if MQ2Medley is currently trying to cast spells
+Medley.Bards
+- int number of coordinating bards on this PC sharing our channel, including us. 0 if not coordinating
+Medley.State
+- string current scheduler state: Idle, Scheduling, Casting, Recovering, TargetRestore, Paused, Memorizing or Bursting
+Medley.StateCount[state]
+- int number of times the scheduler entered the given state
+Medley.SwapWindow
+- int ms the target was switched for the last queued song with a target
+Medley.Utilization
+- double % of our time the medley needs to keep every song up, over 100 can't be sustained
+Medley.Coverage
+- double % of song uptime the medley can sustain
+Medley.CycleTime
+- double seconds to sing every song once, Delay included
+Medley.Bottleneck
+- string songs that wear off before the medley comes back around to them
+Medley.MemberCoverage[name]
+- double % of the medley's group songs up on a group member
+Medley.MemberMissing[name]
+- string the medley's group songs that are down on a group member
 ----------------------------
 
 The ini file has the format:
 [MQ2Medley]
 Delay=3       Delay between twists in 1/10th of second. Lag & System dependant.
+QueueTTL=0    Seconds a queued song waits before it is dropped when queued without -ttl, 0 for forever
+Coordinate=0  1 to share song timers with other MQ2Medley bards on the same PC
+CoordinateChannel=   only coordinate with bards using the same channel name, empty for all
+NativeCast=1  0 to send casts as /multiline commands instead of calling the cast handlers directly
+SwapGems=     gems songs that aren't memorized may be memorized into when needed, e.g. 12,13
 [MQ2Medley-medleyname]   can multiple one of these sections, for each medley you define
 songIF=Condition to turn entire block on/off
 song1=Name of Song/Item/AA^expression representing duration of song^condition expression for this song to be song
@@ -92,14 +126,59 @@ song20=
 
 #include <mq/Plugin.h>
 
+#include <future>
+
+#include "MQ2Medley.h"
+
 PreSetup("MQ2Medley");
 PLUGIN_VERSION(1.07);
 
 #define PLUGIN_MSG "\arMQMedley\au:: "
 
+/**
+* Build with MEDLEY_ALLOC_COUNT defined to count the heap allocations this plugin makes during
+* each OnPulse.  Once a medley is loaded and its songs have been cast a pulse should make none,
+* so every pulse that does is reported as a failure.  Code that has to allocate once (a new
+* song's first expiry, swapping in a medley, ...) says so with MEDLEY_ALLOCATION_EXPECTED() and
+* that pulse is not checked.  Allocations on other threads are not counted.
+*/
+#ifdef MEDLEY_ALLOC_COUNT
+thread_local bool countAllocations = false;
+thread_local uint32_t pulseAllocations = 0;
+bool pulseAllocationExpected = false;
+uint32_t allocPulsesChecked = 0;
+uint32_t allocPulsesFailed = 0;         // pulses that allocated when nothing said they would
+uint32_t allocPulsesExempt = 0;
+
+void* operator new(size_t size)
+{
+	if (countAllocations)
+		pulseAllocations++;
+	if (void* p = malloc(size ? size : 1))
+		return p;
+	throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept
+{
+	free(p);
+}
+
+void operator delete(void* p, size_t) noexcept
+{
+	free(p);
+}
+
+#define MEDLEY_ALLOCATION_EXPECTED() (pulseAllocationExpected = true)
+#else
+#define MEDLEY_ALLOCATION_EXPECTED() ((void)0)
+#endif
+
 constexpr int MAX_MEDLEY_SIZE = 30;
 
-class SongData
+// What to cast and under which conditions.  Resolved once when a medley is loaded or a song is
+// queued, then shared by every medley entry, queued entry and cast of it and never changed.
+class SongDescriptor
 {
 private:
 	uint32_t castTimeMs;        // ms
@@ -113,40 +192,218 @@ public:
 
 	std::string name;
 	SpellType type;
-	bool once;                  // is this a cast once spell?
 	bool isDot;                 // is dot, if so track time by spawn ID
-	
-	unsigned int targetID;      // SpawnID
+	std::string entryName;      // name as written in the medley, matches entries across reloads
+	int spellID;                // spell the gem, item or AA casts, 0 if unknown
+	int aaID;                   // AA only, the id /alt act takes
+
 	std::string durationExp;    // duration in seconds, how long the spell lasts, evaluated with Math.Calc
 	std::string conditionalExp; // condition to cast this song under, evaluated with Math.Calc
 	std::string targetExp;      // expression for targetID
+	std::string buffName;       // name of the buff this song leaves on us, used to reconcile expiry
+	bool hasDurationExp;        // durationExp came from the ini, otherwise the duration is learned
+
+	// macro strings built by compile(), so evaluating needs no formatting
+	std::string durationCalc;   // ${Math.Calc[durationExp]}
+	std::string conditionCalc;  // ${Math.Calc[conditionalExp]}
+	std::string targetCalc;     // ${Math.Calc[targetExp]}
+	std::string readyCalc;      // item timer or AA ready check
 public:
-	SongData(std::string spellName, SpellType spellType, uint32_t spellCastTimeMs);
+	SongDescriptor(std::string spellName, SpellType spellType, uint32_t spellCastTimeMs);
 
-	bool isReady();  // true if spell/item/aa is ready to cast (no timer)
+	void compile();  // call after the expressions are set
+	std::string entryKey() const { return entryName + "^" + durationExp + "^" + conditionalExp + "^" + targetExp; }
+	bool isReady() const;  // true if spell/item/aa is ready to cast (no timer)
+	int64_t readyInMs() const;  // ms until ready to cast, 0 if ready, -1 if unknown
 	uint32_t getCastTimeMs() const;
-	double evalDuration();
-	bool evalCondition();
-	DWORD evalTarget();
+	double evalDuration() const;
+	bool evalCondition() const;
+	DWORD evalTarget() const;
+	float groupRange() const;  // range the song reaches group members in, 0 if not a group song
 };
 
-const SongData nullSong = SongData("", SongData::NOT_FOUND, 0);
+using SongHandle = std::shared_ptr<const SongDescriptor>;
+
+// A medley entry, queued song or cast in flight: a shared descriptor plus the little state that
+// belongs to this one use of it.  Cheap to copy, no strings.
+class SongData
+{
+public:
+	enum QueuePriority {
+		PRIORITY_LOW = 0,
+		PRIORITY_NORMAL = 1,
+		PRIORITY_HIGH = 2
+	};
+
+	SongHandle desc;            // null for no song
+	bool once;                  // is this a cast once spell?
+	unsigned int targetID;      // SpawnID
+	int priority;               // once queue: higher is cast first, FIFO within the same priority
+	uint64_t queuedMs;          // once queue: tick the song was queued
+	uint64_t deadlineMs;        // once queue: dropped if not started by this tick, 0 for never
+public:
+	SongData() : once(false), targetID(0), priority(PRIORITY_NORMAL), queuedMs(0), deadlineMs(0) {}
+	explicit SongData(SongHandle descriptor) : SongData() { desc = std::move(descriptor); }
+
+	bool isNull() const { return !desc; }
+	void clear() { *this = SongData(); }
+};
 
 bool MQ2MedleyEnabled = false;
 uint32_t castPadTimeMs = 300;               // ms to give spell time to finish
 std::list<SongData> medley;                // medley[n] = stores medley list
+uint32_t medleyGeneration = 0;             // bumped whenever medley is rebuilt, invalidates iterators into it
+std::list<SongData> onceQueue;             // songs to cast once, ordered by priority then queue time
+uint32_t defaultQueueTTLMs = 0;            // ttl for queued songs without -ttl, 0 for none
+uint32_t queueDropped = 0;                 // stale queued songs dropped without casting
+uint32_t speculativeHits = 0;              // pre-evaluated pick still valid at CastDue, see Speculative pre-evaluation
+uint32_t speculativeMisses = 0;            // had to fall back to a full scheduleNextSong
+
+/**
+* Burst
+*
+* /medley burst fires a list of instant AAs and clicks one after another, without the cast pad
+* between them, then the medley picks up again.  Each action only waits until it is ready, one
+* that isn't ready within BURST_READY_WAIT_MS is skipped.  Actions with a cast time still wait
+* that out, just not the pad.
+*/
+constexpr uint64_t BURST_READY_WAIT_MS = 2000;
+constexpr uint32_t INSTANT_CAST_MS = 100;   // instant gems are resolved to this cast time
+std::list<SongData> burstQueue;            // actions left to fire
+SongData burstAction;                      // fired, complete at burstNextMs
+uint64_t burstQueuedMs = 0;
+uint64_t burstStartMs = 0;                 // first action fired, 0 if none yet
+uint64_t burstLastFiredMs = 0;
+uint64_t burstNextMs = 0;
+uint64_t burstWaitStartMs = 0;             // front action started waiting to be ready, 0 if it isn't waiting
+uint32_t burstFired = 0;
+uint32_t burstSkipped = 0;
+uint32_t burstCount = 0;                   // bursts completed
+uint64_t burstTotalMs = 0;
+uint64_t burstMaxMs = 0;
+uint64_t burstLastMs = 0;
 std::string medleyName;
+std::vector<int> swapGems;                 // 0 based gems we may memorize songs into, see Gem management
+
+// one medley section as read from the INI, before any names are resolved
+struct MedleyEntryDef
+{
+	std::string name;
+	std::string durationExp = "180";    // SongDescriptor defaults, so a bare name keys the same
+	std::string conditionalExp = "1";
+	std::string targetExp;
+	bool hasDurationExp = false;
+
+	// same as SongDescriptor::entryKey() of the descriptor resolved from this entry
+	std::string key() const { return name + "^" + durationExp + "^" + conditionalExp + "^" + targetExp; }
+};
+
+struct MedleyDefinition
+{
+	std::string name;
+	std::vector<MedleyEntryDef> entries;
+	std::string songIF;
+	bool play = false;         // start playing once swapped in
+};
+
+std::future<MedleyDefinition> pendingMedley;   // background medley read, see readMedleyDefinition
+uint32_t pendingMedleyStops = 0;               // twistStops when that read was started
 
 std::map<std::string, uint64_t > songExpires;   // when cast, songExpires["songName"] = epoch(ms) + SongDurationMs
 std::map<unsigned int, std::map<std::string, uint64_t >> songExpiresMob; // for per mob tracking
 
+// what we have seen of each song's buff on ourself, used to reconcile songExpires and learn durations
+struct SongObservation
+{
+	uint64_t landedMs = 0;          // tick the last successful cast finished
+	bool observedSinceCast = false; // buff has been seen since landedMs
+	bool seenOnSelf = false;        // song has ever shown up on us, so missing buff means it was removed
+	uint32_t learnedDurationMs = 0; // 0 if not learned yet
+};
+std::map<std::string, SongObservation> songObservations;
+
 // song to song state variables
-SongData currentSong = nullSong;
-boolean bWasInterrupted = false;
+SongData currentSong;
 uint64_t CastDue = 0;
 PSPAWNINFO TargetSave = nullptr;
+bool bTargetSwapped = false;        // pTarget is borrowed, TargetSave (may be null) gets put back
+int castSpellID = 0;                // spell ID of the gem being cast, 0 for items, AAs or unknown
+
+// how long a borrowed target is held, from swap until the cast is seen starting
+constexpr uint64_t TARGET_RESTORE_TIMEOUT_MS = 500;
+uint64_t targetSwapMs = 0;
+uint32_t targetSwapCount = 0;
+uint32_t targetSwapTimeouts = 0;
+uint64_t targetSwapTotalMs = 0;
+uint64_t targetSwapMaxMs = 0;
+uint64_t targetSwapLastMs = 0;
+
+// cast dispatch: native calls, or the /multiline command we used to send, and what each costs
+enum class DispatchPath { Native, Command, Count };
+const char* DispatchPathNames[] = { "native (+ /stopsong, /alt act commands)", "command" };
+struct DispatchStats {
+	uint32_t count = 0;
+	uint64_t totalUs = 0;
+	uint64_t maxUs = 0;
+};
+DispatchStats dispatchStats[static_cast<int>(DispatchPath::Count)];
+bool bNativeCast = true;
+
+// OnPulse state machine, each pulse only does the work of the current state
+enum class MedleyState {
+	Idle,           // twist is off or there is no medley
+	Scheduling,     // pick the next song and start it
+	Casting,        // song is being sung, waiting for CastDue
+	Recovering,     // song was interrupted, recast or move on once we can
+	TargetRestore,  // song went out on a borrowed target, put ours back
+	Paused,         // twist is on, but we can't sing (sitting, stunned, SongIF, ...)
+	Memorizing,     // memorizing a song into a swap gem
+	Bursting,       // firing /medley burst actions back to back
+	Count
+};
+constexpr int MEDLEY_STATE_COUNT = static_cast<int>(MedleyState::Count);
+const char* MedleyStateNames[MEDLEY_STATE_COUNT] = { "Idle", "Scheduling", "Casting", "Recovering", "TargetRestore", "Paused", "Memorizing", "Bursting" };
+
+MedleyState medleyState = MedleyState::Idle;
+uint64_t stateEnteredMs = 0;
+uint32_t stateTransitions[MEDLEY_STATE_COUNT][MEDLEY_STATE_COUNT] = {};  // [from][to]
+uint64_t stateTimeMs[MEDLEY_STATE_COUNT] = {};                           // time spent in each state
+
+// chat events are only recorded here, the state machine acts on them on the next pulse
+enum class CastEvent {
+	None,
+	Interrupted,
+	Stunned
+};
+CastEvent castEvent = CastEvent::None;
+
+void setMedleyState(MedleyState newState)
+{
+	if (newState == medleyState)
+		return;
+
+	const uint64_t now = MQGetTickCount64();
+	if (stateEnteredMs)
+		stateTimeMs[static_cast<int>(medleyState)] += now - stateEnteredMs;
+	stateTransitions[static_cast<int>(medleyState)][static_cast<int>(newState)]++;
+	DebugSpew("MQ2Medley::setMedleyState %s -> %s", MedleyStateNames[static_cast<int>(medleyState)], MedleyStateNames[static_cast<int>(newState)]);
+
+	medleyState = newState;
+	stateEnteredMs = now;
+}
+
+// -1 if name is not a state
+int findMedleyState(const char* name)
+{
+	for (int i = 0; i < MEDLEY_STATE_COUNT; i++) {
+		if (!_stricmp(name, MedleyStateNames[i]))
+			return i;
+	}
+	return -1;
+}
 
 bool bTwist = false;
+uint32_t twistStops = 0;    // bumped whenever the twist is stopped, see applyPendingMedley
 
 bool quiet = false;
 bool DebugMode = false;
@@ -154,37 +411,51 @@ bool Initialized = false;
 char SongIF[MAX_STRING] = "";
 
 
+// drop the burst without recording it
+void cancelBurst()
+{
+	burstQueue.clear();
+	burstAction.clear();
+	burstStartMs = burstLastFiredMs = burstNextMs = burstWaitStartMs = 0;
+	burstFired = burstSkipped = 0;
+}
+
 void resetTwistData()
 {
+	cancelBurst();
+	pendingMedley = {};
 	medley.clear();
+	medleyGeneration++;
+	onceQueue.clear();
 	medleyName = "";
 
-	currentSong = nullSong;
-	bWasInterrupted = false;
+	currentSong.clear();
+	castEvent = CastEvent::None;
 
 	bTwist = false;
+	twistStops++;
 	SongIF[0] = 0;
 	WritePrivateProfileString("MQ2Medley", "Playing", "0", INIFileName);
 	WritePrivateProfileString("MQ2Medley", "Medley", "", INIFileName);
 }
 
-// returns time in seconds till quest is empty. millisecond precision
-double getTimeTillQueueEmpty()
+// returns ms till the once queue is empty, 0 if nothing is queued
+int64_t getTimeTillQueueEmptyMs()
 {
-	double time = 0.0;
+	int64_t time = 0;
 	boolean isOnceQueued = false;
 
-	for (auto song = medley.begin(); song != medley.end(); song++) {
-		if (song->once) {
-			isOnceQueued = true;
-			time += castPadTimeMs;
-			time += song->getCastTimeMs();
-		}
+	for (auto song = onceQueue.begin(); song != onceQueue.end(); song++) {
+		isOnceQueued = true;
+		time += castPadTimeMs;
+		time += song->desc->getCastTimeMs();
 	}
 
 	if (currentSong.once || isOnceQueued) {
-		// FIXME: Narrowing implicit conversion
-		time += CastDue - MQGetTickCount64();
+		// CastDue may already have passed
+		const uint64_t now = MQGetTickCount64();
+		if (CastDue > now)
+			time += static_cast<int64_t>(CastDue - now);
 	}
 
 	return time;
@@ -200,192 +471,1292 @@ void Evaluate(char* zOutput, const char* zFormat, ...)
 }
 
 
-// -1 if not found
-// cast time in ms if found
-int GetItemCastTime(const std::string& ItemName)
+void MQ2MedleyDoCommand(const char* szLine)
 {
-	char zOutput[MAX_STRING] = { 0 };
-	sprintf_s(zOutput, "${FindItem[=%s].CastTime}", ItemName.c_str());
-	ParseMacroData(zOutput, MAX_STRING);
-	DebugSpew("MQ2Medley::GetItemCastTime ${FindItem[=%s].CastTime} returned=%s", ItemName.c_str(), zOutput);
-	return GetIntFromString(zOutput, -1);
+	DebugSpew("MQ2Medley::MQ2MedleyDoCommand(%s)", szLine);
+	DoCommand(szLine);
 }
 
-// -1 if not found
-// cast time in ms if found
-int GetAACastTime(const std::string& AAName)
+// cast time of a memorized spell after focus and AA modifiers, never below half the base time
+int SpellCastTime(PSPELL pSpell)
 {
-	char zOutput[MAX_STRING] = { 0 };
-	sprintf_s(zOutput, "${Me.AltAbility[%s].Spell.CastTime}", AAName.c_str());
-	ParseMacroData(zOutput, MAX_STRING);
-	DebugSpew("MQ2Medley::GetAACastTime ${Me.AltAbility[%s].Spell.CastTime} returned=%s", AAName.c_str(), zOutput);
-	return GetIntFromString(zOutput, -1);
-}
+	ItemPtr n;
+	const float mct = static_cast<float>(GetCastingTimeModifier(pSpell) + GetFocusCastingTimeModifier(pSpell, n, false) + pSpell->CastTime);
+	if (mct < 0.50f * static_cast<float>(pSpell->CastTime))
+		return static_cast<int>(0.50 * (pSpell->CastTime));
 
-void MQ2MedleyDoCommand(const char* szLine)
-{
-	DebugSpew("MQ2Medley::MQ2MedleyDoCommand(%s)", szLine);
-	DoCommand(szLine);
+	return static_cast<int>(mct);
 }
 
+// -1 if not memorized
 int GemCastTime(const std::string& spellName)
 {
-	ItemPtr n;
 	// Gem 1 to NUM_SPELL_GEMS
 	for (int i = 0; i < NUM_SPELL_GEMS; i++)
 	{
-		// TODO: This logic could be further refined.
 		PSPELL pSpell = GetSpellByID(GetPcProfile()->MemorizedSpells[i]);
-		if (pSpell && starts_with(pSpell->Name, spellName)) {
-			const float mct = static_cast<float>(GetCastingTimeModifier(pSpell) + GetFocusCastingTimeModifier(pSpell, n, false) + pSpell->CastTime);
-			if (mct < 0.50f * static_cast<float>(pSpell->CastTime))
-				return static_cast<int>(0.50 * (pSpell->CastTime));
-
-			return static_cast<int>(mct);
-		}
+		if (pSpell && starts_with(pSpell->Name, spellName))
+			return SpellCastTime(pSpell);
 	}
 
 	return -1;
 }
 
 /**
-* Get the current casting spell and store in szCurrentCastingSpell, if failed to udpate this will return false
+* true once we have started casting spellID, or anything at all if spellID is 0
+* Used to hold a borrowed target until the game has taken the cast.
+*/
+bool isCastStarted(int spellID)
+{
+	PCHARINFO pCharInfo = GetCharInfo();
+	if (!pCharInfo || !pCharInfo->pSpawn)
+		return false;
+	const int castingID = pCharInfo->pSpawn->CastingData.SpellID;
+	if (castingID > 0)
+		return !spellID || castingID == spellID;
+	return !spellID && pCastingWnd && pCastingWnd->IsVisible();
+}
+
+/**
+* Native cast tracking
+*
+* Our spawn's casting data is sampled every pulse while a song is out.  The cast is seen starting
+* when it shows the song, complete when it clears at about the cast time, and interrupted when it
+* clears well before that.  Chat lines are only the fallback for casts we never saw start, like
+* instant casts that come and go between pulses.  Detection latency for both is measured from
+* the last pulse the cast was seen still running.
 */
-//bool getCurrentCastingSpell()
-//{
-//	DebugSpew("MQ2Medley::getCurrentCastingSpell -ENTER ");
-//	PCSIDLWND pCastingWindow = (PCSIDLWND)pCastingWnd;
-//	if (!pCastingWindow->IsVisible())
-//	{
-//		DebugSpew("MQ2Medley::getCurrentCastingSpell - not active", szCurrentCastingSpell);
-//		return false;
-//	}
-//	if (CXWnd *Child = ((CXWnd*)pCastingWnd)->GetChildItem("Casting_SpellName")) {
-//		if (GetCXStr(Child->WindowText, szCurrentCastingSpell, 2047) && szCurrentCastingSpell[0] != '\0') {
-//			DebugSpew("MQ2Medley::getCurrentCastingSpell -- current cast is: ", szCurrentCastingSpell);
-//			return true;
-//		}
-//	}
-//	return false;
-//}
-
-
-SongData getSongData(const char* name)
-{
-	std::string spellName = name;  // gem spell, item, or AA
-
-	// if spell name is a # convert to name for that gem
-	const int spellNum = GetIntFromString(name, 0);
-	if (spellNum>0 && spellNum <= NUM_SPELL_GEMS) {
-		DebugSpew("MQ2Medley::TwistCommand Parsing gem %d", spellNum);
-		PSPELL pSpell = GetSpellByID(GetPcProfile()->MemorizedSpells[spellNum - 1]);
-		if (pSpell) {
-			spellName = pSpell->Name;
+constexpr uint64_t NATIVE_END_TOLERANCE_MS = 250;    // cleared this close to the cast time counts as complete
+constexpr uint64_t NATIVE_START_TIMEOUT_MS = 1000;   // a longer cast not seen starting by now didn't start
+constexpr uint64_t CHAT_CONFIRM_WINDOW_MS = 1500;    // interrupt lines this soon after a native interrupt are about it
+struct CastWatch {
+	uint64_t sentMs = 0;        // cast sent to the game
+	uint64_t castTimeMs = 0;
+	uint64_t startSeenMs = 0;   // first pulse the cast was seen, 0 if not yet
+	uint64_t lastSeenMs = 0;    // last pulse the cast was seen running
+	uint64_t completedMs = 0;   // pulse the cast was seen to complete, 0 if not yet
+};
+CastWatch castWatch;
+uint64_t nativeInterruptMs = 0;         // last interrupt found from casting data, 0 once chat confirmed it
+uint64_t nativeInterruptSeenMs = 0;     // lastSeenMs of that cast
+
+enum class NativeCast { Unknown, Running, Completed, Interrupted };
+enum class Detection { StartNative, CompleteNative, CompleteTimer, InterruptNative, InterruptChat, Count };
+const char* DetectionNames[] = { "start (native)", "complete (native)", "complete (timer)", "interrupt (native)", "interrupt (chat)" };
+struct DetectionStats {
+	uint32_t count = 0;
+	int64_t totalMs = 0;
+	int64_t maxMs = 0;
+};
+DetectionStats detectionStats[static_cast<int>(Detection::Count)];
+uint32_t chatInterruptsFirst = 0;       // interrupts chat reported before the casting data showed them
+
+void addDetection(Detection detection, int64_t ms)
+{
+	DetectionStats& stats = detectionStats[static_cast<int>(detection)];
+	stats.count++;
+	stats.totalMs += ms;
+	stats.maxMs = stats.count == 1 ? ms : std::max(stats.maxMs, ms);
+}
+
+void watchCast(uint64_t castTimeMs)
+{
+	castWatch = CastWatch();
+	castWatch.sentMs = MQGetTickCount64();
+	castWatch.castTimeMs = castTimeMs;
+}
+
+// what the casting data says about the song sent by watchCast, called once per pulse
+NativeCast sampleCast()
+{
+	const uint64_t now = MQGetTickCount64();
+	if (castWatch.completedMs)
+		return NativeCast::Completed;
+	if (isCastStarted(castSpellID)) {
+		if (!castWatch.startSeenMs) {
+			castWatch.startSeenMs = now;
+			addDetection(Detection::StartNative, now - castWatch.sentMs);
 		}
-		else {
+		castWatch.lastSeenMs = now;
+		return NativeCast::Running;
+	}
+	if (!castWatch.startSeenMs) {
+		// instant casts can start and finish between pulses, only a longer cast can't be missed
+		if (castWatch.castTimeMs > NATIVE_START_TIMEOUT_MS * 2 && now > castWatch.sentMs + NATIVE_START_TIMEOUT_MS) {
+			DebugSpew("MQ2Medley::sampleCast - cast not seen starting after %I64u ms", now - castWatch.sentMs);
+			return NativeCast::Interrupted;
+		}
+		return NativeCast::Unknown;
+	}
+	if (now + NATIVE_END_TOLERANCE_MS >= castWatch.sentMs + castWatch.castTimeMs) {
+		castWatch.completedMs = now;
+		addDetection(Detection::CompleteNative, now - castWatch.lastSeenMs);
+		// what waiting for the cast time would have cost
+		addDetection(Detection::CompleteTimer, static_cast<int64_t>(castWatch.sentMs + castWatch.castTimeMs + castPadTimeMs) - static_cast<int64_t>(castWatch.lastSeenMs));
+		return NativeCast::Completed;
+	}
+	addDetection(Detection::InterruptNative, now - castWatch.lastSeenMs);
+	nativeInterruptMs = now;
+	nativeInterruptSeenMs = castWatch.lastSeenMs;
+	return NativeCast::Interrupted;
+}
+
+// true if an interrupt line from chat is about an interrupt we already acted on
+bool chatConfirmsInterrupt()
+{
+	const uint64_t now = MQGetTickCount64();
+	if (nativeInterruptMs && now <= nativeInterruptMs + CHAT_CONFIRM_WINDOW_MS) {
+		addDetection(Detection::InterruptChat, now - nativeInterruptSeenMs);
+		nativeInterruptMs = 0;
+		return true;
+	}
+	if (castWatch.lastSeenMs && !castWatch.completedMs) {
+		addDetection(Detection::InterruptChat, now - castWatch.lastSeenMs);
+		chatInterruptsFirst++;
+		castWatch.lastSeenMs = 0;
+	}
+	return false;
+}
+
+
+/**
+* Resolves medley entries to songs, items and AAs.
+*
+* Gems are snapshotted when the resolver is built, owned AAs are indexed by name the first time an
+* AA lookup is needed and inventory clickies are cached per name, so loading a medley walks each
+* table once instead of parsing ${FindItem[]} and ${Me.AltAbility[]} for every song.  Build one per
+* batch and throw it away, it does not notice gems or inventory changing afterwards.
+*
+* Gem names match by prefix ("Selo's" finds "Selo's Accelerating Chorus") like they always have.
+* An exact name wins over a prefix, a prefix matching several gems uses the lowest gem and says so.
+*/
+class SongResolver
+{
+public:
+	struct Entry {
+		std::string name;          // name the song is stored under
+		std::string spellName;     // spell the item or AA casts
+		int spellID = 0;
+		int aaID = 0;
+		int castTime = -1;         // -1 if not found
+	};
+
+	explicit SongResolver(const std::string& context) : context(context)
+	{
+		refreshGems();
+	}
+
+	// gems change whenever a song is memorized, the item and AA lookups are kept
+	void refreshGems()
+	{
+		PcProfile* pProfile = GetPcProfile();
+		for (int i = 0; i < NUM_SPELL_GEMS; i++)
+			gems[i] = pProfile ? GetSpellByID(pProfile->MemorizedSpells[i]) : nullptr;
+	}
+
+	// null if name is not a memorized song, item or AA
+	std::shared_ptr<SongDescriptor> resolve(const char* name)
+	{
+		// if spell name is a # convert to name for that gem
+		const int spellNum = GetIntFromString(name, 0);
+		if (spellNum > 0 && spellNum <= NUM_SPELL_GEMS) {
+			DebugSpew("MQ2Medley::SongResolver Parsing gem %d", spellNum);
+			if (PSPELL pSpell = gems[spellNum - 1])
+				return makeGem(pSpell);
 			WriteChatf(PLUGIN_MSG "\arInvalid spell number specified (\ay%s\ar) - ignoring.", name);
-			return nullSong;
+			return nullptr;
+		}
+
+		if (PSPELL pSpell = findGem(name))
+			return makeGem(pSpell);
+
+		const Entry& item = findItem(name);
+		if (item.castTime >= 0) {
+			auto song = std::make_shared<SongDescriptor>(item.name, SongDescriptor::ITEM, item.castTime);
+			song->buffName = item.spellName;
+			song->spellID = item.spellID;
+			return song;
+		}
+
+		if (const Entry* aa = findAA(name)) {
+			auto song = std::make_shared<SongDescriptor>(aa->name, SongDescriptor::AA, aa->castTime);
+			song->buffName = aa->spellName;
+			song->spellID = aa->spellID;
+			song->aaID = aa->aaID;
+			return song;
 		}
+
+		if (PSPELL pSpell = findBookSong(name)) {
+			if (swapGems.empty()) {
+				WriteChatf(PLUGIN_MSG "\ay[%s] \"%s\" is not memorized, set SwapGems to have it memorized when needed.", context.c_str(), pSpell->Name);
+				return nullptr;
+			}
+			if (!quiet) WriteChatf(PLUGIN_MSG "[%s] \at%s\ax is not memorized, it will be memorized when needed", context.c_str(), pSpell->Name);
+			return makeGem(pSpell);
+		}
+
+		return nullptr;
 	}
 
-	int castTime = GemCastTime(spellName);
-	if (castTime >= 0)
+private:
+	std::string context;
+	PSPELL gems[NUM_SPELL_GEMS] = {};
+	std::map<std::string, Entry, ci_less> items;   // includes misses
+	std::map<std::string, Entry, ci_less> aas;
+	bool aasIndexed = false;
+
+	std::shared_ptr<SongDescriptor> makeGem(PSPELL pSpell)
 	{
+		int castTime = SpellCastTime(pSpell);
 		if (castTime == 0) {
 			// race condition after casting instant spell (Coalition), sometimes causing next song to be skipped
-			castTime = 100;
+			castTime = INSTANT_CAST_MS;
 		}
-		return SongData(spellName, SongData::SONG, castTime);
+		auto song = std::make_shared<SongDescriptor>(pSpell->Name, SongDescriptor::SONG, castTime);
+		song->spellID = pSpell->ID;
+		return song;
 	}
 
-	castTime = GetItemCastTime(spellName);
-	if (castTime >= 0)
+	PSPELL findGem(const char* name)
 	{
-		return SongData(spellName, SongData::ITEM, castTime);
+		PSPELL match = nullptr;
+		int matches = 0;
+		for (int i = 0; i < NUM_SPELL_GEMS; i++)
+		{
+			PSPELL pSpell = gems[i];
+			if (!pSpell)
+				continue;
+			if (!_stricmp(pSpell->Name, name))
+				return pSpell;
+			if (starts_with(pSpell->Name, name)) {
+				if (!match)
+					match = pSpell;
+				matches++;
+			}
+		}
+		if (matches > 1)
+			WriteChatf(PLUGIN_MSG "\ay[%s] \"%s\" matches %d memorized spells, using \at%s\ay.", context.c_str(), name, matches, match->Name);
+		else if (match && !quiet)
+			WriteChatf(PLUGIN_MSG "[%s] \"%s\" matched \at%s", context.c_str(), name, match->Name);
+		return match;
+	}
+
+	// only looked at when nothing else matched, same prefix rule as gems
+	PSPELL findBookSong(const char* name)
+	{
+		PcProfile* pProfile = GetPcProfile();
+		if (!pProfile)
+			return nullptr;
+		PSPELL match = nullptr;
+		for (int i = 0; i < NUM_BOOK_SLOTS; i++)
+		{
+			PSPELL pSpell = GetSpellByID(pProfile->SpellBook[i]);
+			if (!pSpell)
+				continue;
+			if (!_stricmp(pSpell->Name, name))
+				return pSpell;
+			if (!match && starts_with(pSpell->Name, name))
+				match = pSpell;
+		}
+		return match;
 	}
 
-	castTime = GetAACastTime(spellName);
-	if (castTime >= 0)
+	const Entry& findItem(const char* name)
 	{
-		return SongData(spellName, SongData::AA, castTime);
+		auto it = items.find(name);
+		if (it != items.end())
+			return it->second;
+
+		Entry& entry = items[name];
+		entry.name = name;
+		auto pItem = FindItemByName(name, true);
+		if (pItem) {
+			ItemDefinition* pDef = pItem->GetItemDefinition();
+			if (pDef) {
+				entry.castTime = pDef->Clicky.CastTime;
+				if (PSPELL pSpell = GetSpellByID(pDef->Clicky.SpellID)) {
+					entry.spellName = pSpell->Name;
+					entry.spellID = pSpell->ID;
+				}
+			}
+		}
+		DebugSpew("MQ2Medley::SongResolver item %s cast time %d", name, entry.castTime);
+		return entry;
 	}
 
-	return nullSong;
+	void indexAAs()
+	{
+		aasIndexed = true;
+		if (!pLocalPC || !pLocalPlayer)
+			return;
+		for (int i = 0; i < AA_CHAR_MAX_REAL; i++)
+		{
+			PALTABILITY pAbility = GetAAById(pLocalPC->GetAlternateAbilityId(i), pLocalPlayer->Level);
+			if (!pAbility)
+				continue;
+			const char* aaName = pCDBStr->GetString(pAbility->nName, eAltAbilityName);
+			PSPELL pSpell = GetSpellByID(pAbility->SpellID);
+			if (!aaName || !pSpell)
+				continue;    // passive
+			Entry& entry = aas[aaName];
+			entry.name = aaName;
+			entry.spellName = pSpell->Name;
+			entry.spellID = pSpell->ID;
+			entry.aaID = pAbility->ID;
+			entry.castTime = pSpell->CastTime;
+		}
+		DebugSpew("MQ2Medley::SongResolver indexed %d activated AAs", static_cast<int>(aas.size()));
+	}
+
+	const Entry* findAA(const char* name)
+	{
+		if (!aasIndexed)
+			indexAAs();
+		auto it = aas.find(name);
+		if (it != aas.end())
+			return &it->second;
+
+		// not an error yet, but tell them why a near miss didn't count
+		const size_t len = strlen(name);
+		for (const auto& aa : aas)
+		{
+			if (aa.first.size() > len && !_strnicmp(aa.first.c_str(), name, len)) {
+				WriteChatf(PLUGIN_MSG "\ay[%s] \"%s\" is not an AA, did you mean \at%s\ay?", context.c_str(), name, aa.first.c_str());
+				break;
+			}
+		}
+		return nullptr;
+	}
+};
+
+// Queued songs share one resolver, so the AAs are indexed once rather than on every enqueue.
+// Reset when a medley is loaded, on zoning and at character select.
+std::unique_ptr<SongResolver> queueResolver;
+
+void resetQueueResolver()
+{
+	queueResolver.reset();
 }
 
-const uint64_t getSongExpires(const SongData& song) {
-	if (song.isDot && pTarget) {
-		if (pTarget->SpawnID) {
-			if (songExpiresMob[pTarget->SpawnID].count(song.name)) {
-				return songExpiresMob[pTarget->SpawnID][song.name];
-			} else {
-				return MQGetTickCount64();
+// null if name is not a memorized song, item or AA
+std::shared_ptr<SongDescriptor> getSongData(const char* name)
+{
+	if (!queueResolver)
+		queueResolver = std::make_unique<SongResolver>("queue");
+	else
+		queueResolver->refreshGems();
+	return queueResolver->resolve(name);
+}
+
+/**
+* Shared-memory blackboard
+*
+* Several bards on the same PC each run their own copy of MQ2Medley.  When coordination is on,
+* every instance publishes the songs it sings and when they expire into a small named file
+* mapping.  The schedulers then treat songs covered by another bard as covered, and split songs
+* that several bards share so only one of them (the owner) recasts it.  Nothing leaves the machine.
+*
+* Times in the blackboard are GetTickCount64() based since that clock is shared by every process.
+* The mapping is only touched under its mutex, on the heartbeat and when we claim a song.  Each
+* time our slot is written the whole blackboard is copied to blackboardView, and the scheduler's
+* lookups read that copy, so they never wait for the mutex or see a half written slot.
+*/
+constexpr int BLACKBOARD_VERSION = 1;
+constexpr int BLACKBOARD_MAX_BARDS = 8;
+constexpr int BLACKBOARD_NAME_LEN = 64;
+constexpr uint64_t BLACKBOARD_STALE_MS = 5000;        // slot is abandoned if not refreshed for this long
+constexpr uint64_t BLACKBOARD_HEARTBEAT_MS = 1000;
+constexpr uint64_t BLACKBOARD_OWNER_GRACE_MS = 3000;  // how long a non owner waits for the owner to recast
+
+struct BlackboardSong
+{
+	char name[BLACKBOARD_NAME_LEN];
+	uint64_t expires;           // shared tick the song wears off
+	uint64_t claimedUntil;      // shared tick the publishing bard will finish casting it
+};
+
+struct BlackboardSlot
+{
+	DWORD processId;            // 0 if slot is free
+	uint64_t heartbeat;
+	char owner[BLACKBOARD_NAME_LEN];
+	char channel[BLACKBOARD_NAME_LEN];
+	int songCount;
+	BlackboardSong songs[MAX_MEDLEY_SIZE];
+};
+
+struct Blackboard
+{
+	int version;
+	BlackboardSlot slots[BLACKBOARD_MAX_BARDS];
+};
+
+bool bCoordinate = false;
+char CoordinateChannel[BLACKBOARD_NAME_LEN] = "";
+HANDLE hBlackboardMapping = nullptr;
+HANDLE hBlackboardMutex = nullptr;
+Blackboard* pBlackboard = nullptr;
+Blackboard blackboardView = {};     // copy taken under the lock by publishBlackboard
+bool blackboardViewValid = false;
+int blackboardSlot = -1;
+uint64_t blackboardHeartbeat = 0;
+
+uint64_t toSharedTick(uint64_t tick)
+{
+	if (!tick)
+		return 0;
+	return tick + GetTickCount64() - MQGetTickCount64();
+}
+
+uint64_t fromSharedTick(uint64_t tick)
+{
+	if (!tick)
+		return 0;
+	return tick + MQGetTickCount64() - GetTickCount64();
+}
+
+class BlackboardLock
+{
+public:
+	BlackboardLock() {
+		locked = hBlackboardMutex && WaitForSingleObject(hBlackboardMutex, 50) != WAIT_TIMEOUT;
+	}
+	~BlackboardLock() {
+		if (locked)
+			ReleaseMutex(hBlackboardMutex);
+	}
+	bool locked;
+};
+
+bool isLiveSlot(const BlackboardSlot& slot, uint64_t sharedNow)
+{
+	return slot.processId != 0 && slot.heartbeat + BLACKBOARD_STALE_MS > sharedNow
+		&& !_stricmp(slot.channel, CoordinateChannel);
+}
+
+void closeBlackboard()
+{
+	if (pBlackboard) {
+		// without the lock the slot is left to go stale
+		BlackboardLock lock;
+		if (lock.locked && blackboardSlot >= 0 && pBlackboard->slots[blackboardSlot].processId == GetCurrentProcessId())
+			memset(&pBlackboard->slots[blackboardSlot], 0, sizeof(BlackboardSlot));
+	}
+	if (pBlackboard)
+		UnmapViewOfFile(pBlackboard);
+	if (hBlackboardMapping)
+		CloseHandle(hBlackboardMapping);
+	if (hBlackboardMutex)
+		CloseHandle(hBlackboardMutex);
+	pBlackboard = nullptr;
+	blackboardViewValid = false;
+	hBlackboardMapping = nullptr;
+	hBlackboardMutex = nullptr;
+	blackboardSlot = -1;
+}
+
+bool openBlackboard()
+{
+	if (pBlackboard)
+		return true;
+
+	hBlackboardMutex = CreateMutexA(nullptr, FALSE, "Local\\MQ2Medley_Blackboard_Mutex");
+	hBlackboardMapping = CreateFileMappingA(INVALID_HANDLE_VALUE, nullptr, PAGE_READWRITE, 0, sizeof(Blackboard), "Local\\MQ2Medley_Blackboard");
+	if (!hBlackboardMutex || !hBlackboardMapping) {
+		WriteChatf(PLUGIN_MSG "\arUnable to open shared song blackboard (error %d)", GetLastError());
+		closeBlackboard();
+		return false;
+	}
+	pBlackboard = static_cast<Blackboard*>(MapViewOfFile(hBlackboardMapping, FILE_MAP_ALL_ACCESS, 0, 0, sizeof(Blackboard)));
+	if (!pBlackboard) {
+		WriteChatf(PLUGIN_MSG "\arUnable to map shared song blackboard (error %d)", GetLastError());
+		closeBlackboard();
+		return false;
+	}
+
+	bool locked = false;
+	{
+		// the lock is released before closeBlackboard closes the mutex
+		BlackboardLock lock;
+		locked = lock.locked;
+		if (locked) {
+			if (pBlackboard->version != BLACKBOARD_VERSION) {
+				// fresh mapping is zero filled, or was created by an incompatible build
+				memset(pBlackboard, 0, sizeof(Blackboard));
+				pBlackboard->version = BLACKBOARD_VERSION;
+			}
+
+			const uint64_t sharedNow = GetTickCount64();
+			for (int i = 0; i < BLACKBOARD_MAX_BARDS; i++) {
+				BlackboardSlot& slot = pBlackboard->slots[i];
+				if (slot.processId == GetCurrentProcessId() || slot.processId == 0 || slot.heartbeat + BLACKBOARD_STALE_MS <= sharedNow) {
+					memset(&slot, 0, sizeof(BlackboardSlot));
+					slot.processId = GetCurrentProcessId();
+					slot.heartbeat = sharedNow;
+					blackboardSlot = i;
+					break;
+				}
 			}
 		}
+	}
+	if (!locked) {
+		WriteChatf(PLUGIN_MSG "\arShared song blackboard is busy, not coordinating for now");
+		closeBlackboard();
+		return false;
+	}
+	if (blackboardSlot < 0) {
+		WriteChatf(PLUGIN_MSG "\arShared song blackboard is full (%d bards), not coordinating", BLACKBOARD_MAX_BARDS);
+		closeBlackboard();
+		return false;
+	}
+	return true;
+}
+
+// number of live bards on this channel, including us
+int blackboardBardCount()
+{
+	if (!pBlackboard || !blackboardViewValid)
+		return 0;
+	const uint64_t sharedNow = GetTickCount64();
+	int count = 0;
+	for (const BlackboardSlot& slot : blackboardView.slots) {
+		if (isLiveSlot(slot, sharedNow))
+			count++;
+	}
+	return count;
+}
+
+// Latest expiry published for songName by any other live bard on our channel, 0 if none.
+// A song another bard is in the middle of casting counts as covered for the claim window.
+uint64_t blackboardCoveredUntil(const std::string& songName)
+{
+	if (!pBlackboard || !blackboardViewValid)
+		return 0;
+	const uint64_t sharedNow = GetTickCount64();
+	uint64_t covered = 0;
+	for (int i = 0; i < BLACKBOARD_MAX_BARDS; i++) {
+		const BlackboardSlot& slot = blackboardView.slots[i];
+		if (i == blackboardSlot || !isLiveSlot(slot, sharedNow))
+			continue;
+		for (int j = 0; j < slot.songCount && j < MAX_MEDLEY_SIZE; j++) {
+			const BlackboardSong& song = slot.songs[j];
+			if (_stricmp(song.name, songName.c_str()))
+				continue;
+			covered = std::max(covered, song.expires);
+			if (song.claimedUntil > sharedNow)
+				covered = std::max(covered, song.claimedUntil + BLACKBOARD_OWNER_GRACE_MS);
+		}
+	}
+	return fromSharedTick(covered);
+}
+
+// Songs that more than one bard sings are split between them: the owner is picked by hashing
+// the song name over the live bards that publish it, ordered by slot.  Non owners hold off
+// for BLACKBOARD_OWNER_GRACE_MS so the owner gets to recast first.
+bool blackboardIsOwner(const std::string& songName)
+{
+	if (!pBlackboard || !blackboardViewValid || blackboardSlot < 0)
+		return true;
+	const uint64_t sharedNow = GetTickCount64();
+	int singers[BLACKBOARD_MAX_BARDS];
+	int singerCount = 0;
+	for (int i = 0; i < BLACKBOARD_MAX_BARDS; i++) {
+		const BlackboardSlot& slot = blackboardView.slots[i];
+		if (i != blackboardSlot && !isLiveSlot(slot, sharedNow))
+			continue;
+		bool sings = i == blackboardSlot;
+		for (int j = 0; !sings && j < slot.songCount && j < MAX_MEDLEY_SIZE; j++)
+			sings = !_stricmp(slot.songs[j].name, songName.c_str());
+		if (sings)
+			singers[singerCount++] = i;
+	}
+	if (singerCount <= 1)
+		return true;
+
+	uint32_t hash = 2166136261u;
+	for (const char* c = songName.c_str(); *c; c++)
+		hash = (hash ^ static_cast<uint8_t>(tolower(*c))) * 16777619u;
+	return singers[hash % singerCount] == blackboardSlot;
+}
+
+void publishBlackboard(const char* claimedSong, uint64_t claimedUntil);
+
+const uint64_t getSongExpires(const SongDescriptor& song) {
+	if (song.isDot && pTarget) {
+		// find, not [], looking a song up must not insert it
+		auto mob = songExpiresMob.find(pTarget->SpawnID);
+		if (pTarget->SpawnID && mob != songExpiresMob.end()) {
+			auto tracked = mob->second.find(song.name);
+			if (tracked != mob->second.end())
+				return tracked->second;
+		}
+		return MQGetTickCount64();
+	}
+	else {
+		uint64_t expires = MQGetTickCount64();
+		auto tracked = songExpires.find(song.name);
+		if (tracked != songExpires.end()) {
+			expires = tracked->second;
+		}
+		if (bCoordinate && pBlackboard) {
+			expires = std::max(expires, blackboardCoveredUntil(song.name));
+			if (!blackboardIsOwner(song.name))
+				expires += BLACKBOARD_OWNER_GRACE_MS;
+		}
+		return expires;
+	}
+}
+
+void setSongExpires(const SongDescriptor& song, uint64_t expires) {
+	if (song.isDot) {
+		if (pTarget && pTarget->SpawnID) {
+			auto& mob = songExpiresMob[pTarget->SpawnID];
+			if (!mob.count(song.name))
+				MEDLEY_ALLOCATION_EXPECTED();
+			mob[song.name] = expires;
+		}
 		else {
-			return MQGetTickCount64();
+			// TODO: This shouldn't happen
+		}
+	}
+	else {
+		if (!songExpires.count(song.name))
+			MEDLEY_ALLOCATION_EXPECTED();
+		// other bards see it on our next heartbeat
+		songExpires[song.name] = expires;
+	}
+}
+
+// Write our medley and its expiry times into our blackboard slot.  claimedSong is the song we
+// are about to cast, so other bards don't start it at the same time.
+void publishBlackboard(const char* claimedSong, uint64_t claimedUntil)
+{
+	if (!pBlackboard || blackboardSlot < 0)
+		return;
+	BlackboardLock lock;
+	if (!lock.locked) {
+		// skipped, not written without the lock; the next heartbeat tries again
+		blackboardHeartbeat = MQGetTickCount64();
+		return;
+	}
+
+	BlackboardSlot& slot = pBlackboard->slots[blackboardSlot];
+	if (slot.processId != GetCurrentProcessId()) {
+		// our slot was reclaimed after we went stale (e.g. long loading screen)
+		blackboardSlot = -1;
+		return;
+	}
+	slot.heartbeat = GetTickCount64();
+	blackboardHeartbeat = MQGetTickCount64();
+	if (PCHARINFO pCharInfo = GetCharInfo())
+		strcpy_s(slot.owner, pCharInfo->Name);
+	strcpy_s(slot.channel, CoordinateChannel);
+
+	int count = 0;
+	for (const SongData& entry : medley) {
+		const SongDescriptor& song = *entry.desc;
+		if (song.isDot || count >= MAX_MEDLEY_SIZE)
+			continue;
+		BlackboardSong& published = slot.songs[count++];
+		const bool claimed = claimedUntil && claimedSong && !_stricmp(claimedSong, song.name.c_str());
+		// keep a claim alive across the periodic heartbeat publishes
+		const uint64_t previousClaim = !_stricmp(published.name, song.name.c_str()) ? published.claimedUntil : 0;
+		strncpy_s(published.name, song.name.c_str(), _TRUNCATE);
+		auto own = songExpires.find(song.name);
+		published.expires = own != songExpires.end() ? toSharedTick(own->second) : 0;
+		published.claimedUntil = claimed ? toSharedTick(claimedUntil) : (previousClaim > slot.heartbeat ? previousClaim : 0);
+	}
+	slot.songCount = count;
+	memcpy(&blackboardView, pBlackboard, sizeof(Blackboard));
+	blackboardViewValid = true;
+}
+
+constexpr uint64_t RECONCILE_INTERVAL_MS = 1000;  // how often one song gets reconciled against our buffs
+constexpr uint64_t BUFF_TICK_MS = 6000;           // buff durations are only reported to the tick
+constexpr uint64_t BUFF_LAND_MS = 3000;           // time after a cast before a missing buff counts as removed
+constexpr uint64_t LEARN_WINDOW_MS = 12000;       // only learn from observations this soon after the cast
+
+uint64_t reconcileDue = 0;
+size_t reconcileIndex = 0;
+
+// -1 if buffName is not on us as a song or buff
+// remaining duration in ms if found
+int64_t GetSelfBuffRemainingMs(const std::string& buffName)
+{
+	if (buffName.empty())
+		return -1;
+
+	char zOutput[MAX_STRING] = { 0 };
+	sprintf_s(zOutput, "${Me.Song[%s].Duration.TotalSeconds}", buffName.c_str());
+	ParseMacroData(zOutput, MAX_STRING);
+	if (!_stricmp(zOutput, "null")) {
+		sprintf_s(zOutput, "${Me.Buff[%s].Duration.TotalSeconds}", buffName.c_str());
+		ParseMacroData(zOutput, MAX_STRING);
+		if (!_stricmp(zOutput, "null"))
+			return -1;
+	}
+	return static_cast<int64_t>(GetIntFromString(zOutput, 0)) * 1000;
+}
+
+// called once the song finished casting without interruption
+void songLanded(const SongDescriptor& song)
+{
+	if (!songObservations.count(song.name))
+		MEDLEY_ALLOCATION_EXPECTED();
+	SongObservation& observation = songObservations[song.name];
+	observation.landedMs = MQGetTickCount64();
+	observation.observedSinceCast = false;
+}
+
+// Compare what we think is left on song with what is actually on us.  Picks up focus effects
+// that change the duration, songs that were clicked off or dispelled, and learns durations for
+// songs with no duration expression.
+void reconcileSongExpires(const SongDescriptor& song)
+{
+	if (song.isDot)
+		return;
+
+	const uint64_t now = MQGetTickCount64();
+	if (!songObservations.count(song.name))
+		MEDLEY_ALLOCATION_EXPECTED();
+	SongObservation& observation = songObservations[song.name];
+	const int64_t remainingMs = GetSelfBuffRemainingMs(song.buffName);
+	auto tracked = songExpires.find(song.name);
+
+	if (remainingMs < 0) {
+		// only a song we've seen on ourself before can be missing, others may never land on us
+		if (observation.seenOnSelf && observation.landedMs && now > observation.landedMs + BUFF_LAND_MS
+			&& tracked != songExpires.end() && tracked->second > now) {
+			if (DebugMode) WriteChatf("MQ2Medley::reconcileSongExpires - %s is gone, %I64u ms early", song.name.c_str(), tracked->second - now);
+			setSongExpires(song, now);
+		}
+		return;
+	}
+
+	observation.seenOnSelf = true;
+	if (observation.landedMs && !observation.observedSinceCast && now < observation.landedMs + LEARN_WINDOW_MS) {
+		// round to the buff tick, the reported remaining time is only that precise
+		const uint64_t observedMs = ((now - observation.landedMs + remainingMs + BUFF_TICK_MS / 2) / BUFF_TICK_MS) * BUFF_TICK_MS;
+		if (observedMs && observedMs != observation.learnedDurationMs) {
+			if (DebugMode) WriteChatf("MQ2Medley::reconcileSongExpires - learned %s lasts %I64u ms", song.name.c_str(), observedMs);
+			observation.learnedDurationMs = static_cast<uint32_t>(observedMs);
+		}
+	}
+	observation.observedSinceCast = true;
+
+	const uint64_t actualExpires = now + remainingMs;
+	if (tracked == songExpires.end() || actualExpires + BUFF_TICK_MS < tracked->second || actualExpires > tracked->second + BUFF_TICK_MS) {
+		if (DebugMode) WriteChatf("MQ2Medley::reconcileSongExpires - %s has %I64d ms left", song.name.c_str(), remainingMs);
+		setSongExpires(song, actualExpires);
+	}
+}
+
+// reconcile one medley song per RECONCILE_INTERVAL_MS, round robin
+void reconcileNextSong()
+{
+	if (medley.empty() || MQGetTickCount64() < reconcileDue)
+		return;
+	reconcileDue = MQGetTickCount64() + RECONCILE_INTERVAL_MS;
+
+	if (reconcileIndex >= medley.size())
+		reconcileIndex = 0;
+	auto song = medley.begin();
+	std::advance(song, reconcileIndex++);
+	reconcileSongExpires(*song->desc);
+}
+
+/**
+* Cast outcomes
+*
+* Immune, resist and out of range messages are matched to the song that caused them and remembered
+* for the spawn it was cast on, so the scheduler stops spending casts where they can't land.  Only
+* songs with a target of their own are recorded: a targetID, a target expression, or a detrimental
+* song on our target.  Immune messages are matched by the effect they name, a mez immunity is only
+* charged to a mez.
+* Immunities are also remembered by race and name and kept per zone in MQ2Medley_Immune.ini, since
+* the next spawn of the same mob will be immune too.  Resists and range only hold a song back for
+* a little while, they are not a property of the mob.
+*/
+constexpr uint64_t OUTCOME_LAND_GRACE_MS = 250;       // land messages can come just before CastDue
+constexpr uint64_t OUTCOME_WINDOW_MS = 3000;          // land messages later than this after landing aren't about the cast
+constexpr int RESIST_BACKOFF_COUNT = 3;               // resists in a row before backing off
+constexpr uint64_t RESIST_BACKOFF_MS = 12000;
+constexpr uint64_t OUT_OF_RANGE_BACKOFF_MS = 3000;
+constexpr uint64_t BLOCKED_FOREVER = UINT64_MAX;
+
+// the last couple of casts, so a message that arrives after we moved on finds its song
+struct CastRecord
+{
+	SongHandle desc;
+	unsigned int targetID = 0;
+	uint64_t landMs = 0;        // tick the cast should finish
+};
+CastRecord castHistory[2];      // [0] most recent
+
+struct SpawnOutcome
+{
+	uint64_t blockedUntilMs = 0;
+	int resists = 0;
+};
+std::map<unsigned int, std::map<std::string, SpawnOutcome>> spawnOutcomes;  // [SpawnID][song]
+std::map<std::string, std::set<std::string, ci_less>, std::less<>> immuneByName;   // "race|name" -> songs, this zone
+char ImmuneIniFileName[MAX_PATH] = { 0 };
+uint32_t castsSuppressed = 0;
+
+// race|name, written to szKey so looking it up doesn't allocate
+const char* immuneKey(PSPAWNINFO pSpawn, char* szKey, size_t keySize)
+{
+	sprintf_s(szKey, keySize, "%d|%s", pSpawn->GetRace(), pSpawn->DisplayedName);
+	return szKey;
+}
+
+const char* currentZoneShortName()
+{
+	return pZoneInfo ? pZoneInfo->ShortName : "";
+}
+
+void loadImmunities()
+{
+	immuneByName.clear();
+	spawnOutcomes.clear();
+	sprintf_s(ImmuneIniFileName, "%s\\MQ2Medley_Immune.ini", gPathConfig);
+	const char* zone = currentZoneShortName();
+	if (!zone[0])
+		return;
+
+	// key=value\0key=value\0\0, key is race|name and value the songs separated by ^
+	std::vector<char> section(32 * 1024);
+	GetPrivateProfileSectionA(zone, section.data(), static_cast<DWORD>(section.size()), ImmuneIniFileName);
+	for (const char* line = section.data(); *line; line += strlen(line) + 1)
+	{
+		const char* equals = strchr(line, '=');
+		if (!equals)
+			continue;
+		auto& songs = immuneByName[std::string(line, equals)];
+		char szTemp[MAX_STRING] = { 0 };
+		char* pNext;
+		strncpy_s(szTemp, equals + 1, _TRUNCATE);
+		for (char* p = strtok_s(szTemp, "^", &pNext); p; p = strtok_s(nullptr, "^", &pNext))
+			songs.insert(p);
+	}
+	DebugSpew("MQ2Medley::loadImmunities - %d mobs with immunities in %s", static_cast<int>(immuneByName.size()), zone);
+}
+
+void saveImmunities(const std::string& key)
+{
+	std::string value;
+	for (const std::string& song : immuneByName[key])
+		value += (value.empty() ? "" : "^") + song;
+	WritePrivateProfileString(currentZoneShortName(), key.c_str(), value.c_str(), ImmuneIniFileName);
+}
+
+bool isDetrimental(const SongDescriptor& song)
+{
+	PSPELL pSpell = song.spellID ? GetSpellByID(song.spellID) : nullptr;
+	return pSpell && pSpell->SpellType == SpellType_Detrimental;
+}
+
+// The spawn a song will be cast on, 0 for songs without a target of their own (self, group).
+// Evaluates the target expression, so call it once per decision and pass the result along.
+unsigned int songTargetID(const SongData& song)
+{
+	if (song.targetID)
+		return song.targetID;
+	if (!song.desc->targetCalc.empty())
+		return song.desc->evalTarget();
+	return pTarget && isDetrimental(*song.desc) ? pTarget->SpawnID : 0;
+}
+
+// song as picked by a decision, keeping the target it evaluated so casting doesn't evaluate it again
+SongData withTarget(const SongData& song, unsigned int targetID)
+{
+	SongData picked = song;
+	if (!song.desc->targetCalc.empty())
+		picked.targetID = targetID;
+	return picked;
+}
+
+// true if what we learned says song would be wasted on targetID, see songTargetID
+bool isSongBlocked(const SongData& song, unsigned int targetID)
+{
+	if (!targetID || (spawnOutcomes.empty() && immuneByName.empty()))
+		return false;
+
+	auto mob = spawnOutcomes.find(targetID);
+	if (mob != spawnOutcomes.end()) {
+		auto outcome = mob->second.find(song.desc->name);
+		if (outcome != mob->second.end() && outcome->second.blockedUntilMs > MQGetTickCount64())
+			return true;
+	}
+	if (!immuneByName.empty()) {
+		if (PSPAWNINFO pSpawn = (PSPAWNINFO)GetSpawnByID(targetID)) {
+			char szKey[MAX_STRING] = { 0 };
+			auto immune = immuneByName.find(immuneKey(pSpawn, szKey, MAX_STRING));
+			if (immune != immuneByName.end() && immune->second.count(song.desc->name))
+				return true;
 		}
 	}
+	return false;
+}
+
+// call once the song was sent, pTarget is the target it went to
+void recordCast(const SongData& song, uint64_t landMs)
+{
+	if (!song.targetID && song.desc->targetCalc.empty() && !isDetrimental(*song.desc))
+		return;
+	castHistory[1] = castHistory[0];
+	castHistory[0].desc = song.desc;
+	castHistory[0].targetID = song.targetID ? song.targetID : (pTarget ? pTarget->SpawnID : 0);
+	castHistory[0].landMs = landMs;
+}
+
+bool castJustLanded(const CastRecord& cast, uint64_t now)
+{
+	return cast.desc && cast.targetID && cast.landMs <= now + OUTCOME_LAND_GRACE_MS && now <= cast.landMs + OUTCOME_WINDOW_MS;
+}
+
+// the cast a resist message is about
+const CastRecord* landedCast(std::string_view spellName)
+{
+	const uint64_t now = MQGetTickCount64();
+	for (const CastRecord& cast : castHistory)
+	{
+		if (castJustLanded(cast, now) && (ci_equals(cast.desc->buffName, spellName) || ci_equals(cast.desc->name, spellName)))
+			return &cast;
+	}
+	return nullptr;
+}
+
+// the effect an immune message is about, -1 if it doesn't say
+int immuneSpa(std::string_view line)
+{
+	if (starts_with(line, "Your target cannot be mesmerized"))
+		return SPA_ENTHRALL;
+	if (line.find("attack speed") != std::string_view::npos)
+		return SPA_HASTE;
+	if (line.find("run speed") != std::string_view::npos)
+		return SPA_MOVEMENT_RATE;
+	if (line.find("stun") != std::string_view::npos)
+		return SPA_STUN;
+	return -1;
+}
+
+// the cast an immune message is about: one with the effect it names, or any detrimental cast if
+// it doesn't name one
+const CastRecord* immuneCast(int spa)
+{
+	const uint64_t now = MQGetTickCount64();
+	for (const CastRecord& cast : castHistory)
+	{
+		if (!castJustLanded(cast, now))
+			continue;
+		PSPELL pSpell = cast.desc->spellID ? GetSpellByID(cast.desc->spellID) : nullptr;
+		if (pSpell && (spa >= 0 ? HasSPA(pSpell, spa) : pSpell->SpellType == SpellType_Detrimental))
+			return &cast;
+	}
+	return nullptr;
+}
+
+// the song didn't land, so it isn't up
+void forgetSongExpires(const CastRecord& cast)
+{
+	if (cast.desc->isDot) {
+		auto mob = songExpiresMob.find(cast.targetID);
+		if (mob != songExpiresMob.end())
+			mob->second.erase(cast.desc->name);
+	}
+	else
+		songExpires.erase(cast.desc->name);
+}
+
+void songImmune(const CastRecord& cast)
+{
+	spawnOutcomes[cast.targetID][cast.desc->name].blockedUntilMs = BLOCKED_FOREVER;
+	forgetSongExpires(cast);
+	PSPAWNINFO pSpawn = (PSPAWNINFO)GetSpawnByID(cast.targetID);
+	if (!pSpawn)
+		return;
+	char szKey[MAX_STRING] = { 0 };
+	const std::string key = immuneKey(pSpawn, szKey, MAX_STRING);
+	if (immuneByName[key].insert(cast.desc->name).second) {
+		saveImmunities(key);
+		WriteChatf(PLUGIN_MSG "\at%s is immune to %s, not casting it on them again.", pSpawn->DisplayedName, cast.desc->name.c_str());
+	}
+}
+
+void songResisted(const CastRecord& cast)
+{
+	forgetSongExpires(cast);
+	SpawnOutcome& outcome = spawnOutcomes[cast.targetID][cast.desc->name];
+	if (++outcome.resists >= RESIST_BACKOFF_COUNT) {
+		outcome.resists = 0;
+		outcome.blockedUntilMs = MQGetTickCount64() + RESIST_BACKOFF_MS;
+		if (!quiet) WriteChatf(PLUGIN_MSG "\at%s resisted %d times in a row, holding it for %I64u s.", cast.desc->name.c_str(), RESIST_BACKOFF_COUNT, RESIST_BACKOFF_MS / 1000);
+	}
+}
+
+void songOutOfRange(const CastRecord& cast)
+{
+	spawnOutcomes[cast.targetID][cast.desc->name].blockedUntilMs = MQGetTickCount64() + OUT_OF_RANGE_BACKOFF_MS;
+}
+
+// spawn specific outcomes are useless once it is gone
+void forgetSpawnOutcomes(unsigned int spawnID)
+{
+	spawnOutcomes.erase(spawnID);
+}
+
+/**
+* Gem management
+*
+* Songs that are in the spellbook but not memorized can be sung when SwapGems lists gems we may
+* memorize into.  Memorizing is scheduled like a cast with a learned cost: an unmemorized song is
+* due memorizeCostMs before it would be if memorized, and when it is picked it is memorized first,
+* into the swap gem whose song is needed furthest in the future.  The twist stops while we
+* memorize, so it is only done for songs that are due, never to refresh one early.
+*/
+constexpr uint64_t MEMORIZE_TIMEOUT_MS = 20000;
+uint64_t memorizeCostMs = 6000;     // /memspell until the gem is ready, learned
+int memorizeGem = -1;               // 0 based
+SongHandle memorizeSong;
+uint64_t memorizeStartMs = 0;
+uint32_t memorizeCount = 0;
+uint32_t memorizeFailures = 0;
+
+// 0 based gem holding song, -1 if not memorized
+int songGem(const SongDescriptor& song)
+{
+	PcProfile* pProfile = GetPcProfile();
+	if (!pProfile)
+		return -1;
+	for (int i = 0; i < NUM_SPELL_GEMS; i++)
+	{
+		if (song.spellID) {
+			if (pProfile->MemorizedSpells[i] == song.spellID)
+				return i;
+		}
+		else if (PSPELL pSpell = GetSpellByID(pProfile->MemorizedSpells[i])) {
+			if (starts_with(pSpell->Name, song.name))
+				return i;
+		}
+	}
+	return -1;
+}
+
+bool isSongMemorized(const SongDescriptor& song)
+{
+	return song.type != SongDescriptor::SONG || songGem(song) >= 0;
+}
+
+bool canMemorize(const SongDescriptor& song)
+{
+	return song.type == SongDescriptor::SONG && song.spellID && !swapGems.empty();
+}
+
+// when the song in gem is next needed, UINT64_MAX if nothing we sing needs it
+uint64_t gemDemandMs(int gem, uint64_t now)
+{
+	const int spellID = GetPcProfile()->MemorizedSpells[gem];
+	if (!currentSong.isNull() && currentSong.desc->spellID == spellID)
+		return now;
+	for (const SongData& song : onceQueue)
+	{
+		if (song.desc->spellID == spellID)
+			return now;
+	}
+	uint64_t demand = UINT64_MAX;
+	for (const SongData& song : medley)
+	{
+		if (song.desc->spellID != spellID)
+			continue;
+		const uint64_t startCastByMs = getSongExpires(*song.desc) - song.desc->getCastTimeMs() - 3000;
+		demand = std::min(demand, std::max(startCastByMs, now));
+	}
+	return demand;
+}
+
+// 0 based swap gem to memorize into, -1 if every swap gem holds a song we need sooner
+int pickSwapGem(uint64_t now)
+{
+	PcProfile* pProfile = GetPcProfile();
+	if (!pProfile)
+		return -1;
+	int bestGem = -1;
+	uint64_t bestDemand = now + memorizeCostMs;
+	for (int gem : swapGems)
+	{
+		if (!GetSpellByID(pProfile->MemorizedSpells[gem]))
+			return gem;
+		const uint64_t demand = gemDemandMs(gem, now);
+		if (demand > bestDemand) {
+			bestGem = gem;
+			bestDemand = demand;
+		}
+	}
+	return bestGem;
+}
+
+// currentSong is due but not memorized, memorize it.  false if there is no gem for it.
+bool startMemorize()
+{
+	const uint64_t now = MQGetTickCount64();
+	const int gem = pickSwapGem(now);
+	if (gem < 0) {
+		DebugSpew("MQ2Medley::startMemorize - no swap gem free for %s", currentSong.desc->name.c_str());
+		return false;
+	}
+	char szTemp[MAX_STRING] = { 0 };
+	sprintf_s(szTemp, "/memspell %d \"%s\"", gem + 1, currentSong.desc->name.c_str());
+	if (!quiet) WriteChatf(PLUGIN_MSG "\atMemorizing %s in gem %d", currentSong.desc->name.c_str(), gem + 1);
+	MQ2MedleyDoCommand("/stopsong");
+	MQ2MedleyDoCommand(szTemp);
+	memorizeGem = gem;
+	memorizeSong = currentSong.desc;
+	memorizeStartMs = now;
+	return true;
+}
+
+void parseSwapGems(const char* szGems)
+{
+	char szTemp[MAX_STRING] = { 0 };
+	char* pNext;
+	swapGems.clear();
+	strncpy_s(szTemp, szGems, _TRUNCATE);
+	for (char* p = strtok_s(szTemp, ", ", &pNext); p; p = strtok_s(nullptr, ", ", &pNext))
+	{
+		const int gem = GetIntFromString(p, 0);
+		if (gem > 0 && gem <= NUM_SPELL_GEMS)
+			swapGems.push_back(gem - 1);
+		else
+			WriteChatf(PLUGIN_MSG "\arInvalid gem in SwapGems (\ay%s\ar) - ignoring.", p);
+	}
+}
+
+void setCoordinate(bool enable)
+{
+	bCoordinate = enable;
+	if (bCoordinate) {
+		if (!openBlackboard())
+			bCoordinate = false;
+		else
+			blackboardHeartbeat = 0;  // publish on the next pulse
+	}
 	else {
-		if (songExpires.count(song.name)) {
-			return songExpires[song.name];
-		}
-		else {
-			return MQGetTickCount64();
-		}
+		closeBlackboard();
 	}
 }
 
-void setSongExpires(const SongData& song, uint64_t expires) {
-	if (song.isDot) {
-		if (pTarget && pTarget->SpawnID) {
-			songExpiresMob[pTarget->SpawnID][song.name] = expires;
-		}
-		else {
-			// TODO: This shouldn't happen
-		}
+// Stop the song and start song.  The native path calls the /cast and /useitem handlers directly
+// and sends /stopsong and /alt act as plain commands, with nothing for the macro parser to expand.
+// Those commands are timed with it, so the native stats include one or two DoCommand calls.
+// false if it can't handle the song, then the command path is used.
+bool dispatchCastNative(const SongDescriptor& song, int gemNum)
+{
+	if (!pLocalPlayer)
+		return false;
+	char szTemp[MAX_STRING] = { 0 };
+	switch (song.type) {
+	case SongDescriptor::SONG:
+		if (!gemNum)
+			return false;
+		MQ2MedleyDoCommand("/stopsong");
+		sprintf_s(szTemp, "%d", gemNum);
+		Cast(pLocalPlayer, szTemp);
+		return true;
+	case SongDescriptor::ITEM:
+		MQ2MedleyDoCommand("/stopsong");
+		sprintf_s(szTemp, "\"%s\"", song.name.c_str());
+		UseItemCmd(pLocalPlayer, szTemp);
+		return true;
+	case SongDescriptor::AA:
+		if (!song.aaID)
+			return false;
+		MQ2MedleyDoCommand("/stopsong");
+		sprintf_s(szTemp, "/alt act %d", song.aaID);
+		MQ2MedleyDoCommand(szTemp);
+		return true;
+	default:
+		return false;
 	}
-	else {
-		songExpires[song.name] = expires;
+}
+
+void dispatchCastCommand(const SongDescriptor& song, int gemNum)
+{
+	char szTemp[MAX_STRING] = { 0 };
+	switch (song.type) {
+	case SongDescriptor::SONG:
+		sprintf_s(szTemp, "/multiline ; /stopsong ; /cast %d", gemNum);
+		break;
+	case SongDescriptor::ITEM:
+		sprintf_s(szTemp, "/multiline ; /stopsong ; /useitem \"%s\"", song.name.c_str());
+		break;
+	case SongDescriptor::AA:
+		sprintf_s(szTemp, "/multiline ; /stopsong ; /alt act ${Me.AltAbility[%s].ID}", song.name.c_str());
+		break;
+	default:
+		return;
+	}
+	MQ2MedleyDoCommand(szTemp);
+}
+
+// gemNum is the gem holding song, 0 for items and AAs
+void dispatchCast(const SongDescriptor& song, int gemNum)
+{
+	const auto start = std::chrono::steady_clock::now();
+	DispatchPath path = DispatchPath::Native;
+	if (!bNativeCast || !dispatchCastNative(song, gemNum)) {
+		path = DispatchPath::Command;
+		dispatchCastCommand(song, gemNum);
 	}
+	const uint64_t us = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count();
+
+	DispatchStats& stats = dispatchStats[static_cast<int>(path)];
+	stats.count++;
+	stats.totalUs += us;
+	stats.maxUs = std::max(stats.maxUs, us);
+	if (DebugMode) WriteChatf("MQ2Medley::dispatchCast(%s) %s path took %I64u us", song.name.c_str(), DispatchPathNames[static_cast<int>(path)], us);
 }
 
 // returns time it will take to cast (ms)
 // preconditions:
 //   SongTodo is ready to cast
 // -1 - cast failed
-int32_t doCast(const SongData& SongTodo)
+int32_t doCast(const SongData& SongCast)
 {
+	if (SongCast.isNull())
+		return -1;
+	const SongDescriptor& SongTodo = *SongCast.desc;
 	DebugSpew("MQ2Medley::doCast(%s) ENTER", SongTodo.name.c_str());
 	//WriteChatf("MQ2Medley::doCast(%s) ENTER", SongTodo.name.c_str());
-	char szTemp[MAX_STRING] = { 0 };
 	if (GetCharInfo())
 	{
 		if (GetCharInfo()->pSpawn)
 		{
 			switch (SongTodo.type) {
-			case SongData::SONG:
+			case SongDescriptor::SONG:
 				for (int i = 0; i < NUM_SPELL_GEMS; i++)
 				{
 					PSPELL pSpell = GetSpellByID(GetPcProfile()->MemorizedSpells[i]);
 					if (pSpell && starts_with(pSpell->Name, SongTodo.name)) {
 						int gemNum = i + 1;
 
-						if (!SongTodo.targetID) {
+						if (!SongCast.targetID) {
 							// do nothing special
 						}
-						else if (PSPAWNINFO Target = (PSPAWNINFO)GetSpawnByID(SongTodo.targetID)) {
+						else if (PSPAWNINFO Target = (PSPAWNINFO)GetSpawnByID(SongCast.targetID)) {
 							TargetSave = pTarget;
+							bTargetSwapped = true;
+							targetSwapMs = MQGetTickCount64();
 							pTarget = Target;
 							DebugSpew("MQ2Medley::doCast - Set target to %d", Target->SpawnID);
 						}
 						else {
-							WriteChatf("MQ2Medley::doCast - cannot find targetID=%d for to cast \"%s\", SKIPPING", SongTodo.targetID, SongTodo.name.c_str());
+							WriteChatf("MQ2Medley::doCast - cannot find targetID=%d for to cast \"%s\", SKIPPING", SongCast.targetID, SongTodo.name.c_str());
 							return -1;
 						}
 
-						sprintf_s(szTemp, "/multiline ; /stopsong ; /cast %d", gemNum);
-						MQ2MedleyDoCommand(szTemp);
+						castSpellID = pSpell->ID;
+						dispatchCast(SongTodo, gemNum);
 						// FIXME: Narrowing conversion
 						return SongTodo.getCastTimeMs();
 					}
@@ -393,16 +1764,16 @@ int32_t doCast(const SongData& SongTodo)
 				WriteChatf("MQ2Medley::doCast - could not find \"%s\" to cast, SKIPPING", SongTodo.name.c_str());
 
 				return -1;
-			case SongData::ITEM:
+			case SongDescriptor::ITEM:
+				castSpellID = 0;
 				DebugSpew("MQ2Medley::doCast - Next Song (Casting Item  \"%s\")", SongTodo.name.c_str());
-				sprintf_s(szTemp, "/multiline ; /stopsong ; /useitem \"%s\"", SongTodo.name.c_str());
-				MQ2MedleyDoCommand(szTemp);
+				dispatchCast(SongTodo, 0);
 				// FIXME: Narrowing conversion
 				return SongTodo.getCastTimeMs();
-			case SongData::AA:
+			case SongDescriptor::AA:
+				castSpellID = 0;
 				DebugSpew("MQ2Medley::doCast - Next Song (Casting AA  \"%s\")", SongTodo.name.c_str());
-				sprintf_s(szTemp, "/multiline ; /stopsong ; /alt act ${Me.AltAbility[%s].ID}", SongTodo.name.c_str());
-				MQ2MedleyDoCommand(szTemp);
+				dispatchCast(SongTodo, 0);
 				// FIXME: Narrowing conversion
 				return SongTodo.getCastTimeMs();
 			default:
@@ -419,7 +1790,7 @@ void Update_INIFileName(PCHARINFO pCharInfo) {
 	sprintf_s(INIFileName, "%s\\%s_%s.ini", gPathConfig, GetServerShortName(), pCharInfo->Name);
 }
 
-void Load_MQ2Medley_INI_Medley(PCHARINFO pCharInfo, const std::string& medleyNameIni);
+void Load_MQ2Medley_INI_Medley(PCHARINFO pCharInfo, const std::string& medleyNameIni, bool play);
 void Load_MQ2Medley_INI(PCHARINFO pCharInfo)
 {
 	char szTemp[MAX_STRING] = { 0 };
@@ -427,68 +1798,254 @@ void Load_MQ2Medley_INI(PCHARINFO pCharInfo)
 	Update_INIFileName(pCharInfo);
 
 	castPadTimeMs = GetPrivateProfileInt("MQ2Medley", "Delay", 3, INIFileName) * 100;
+	defaultQueueTTLMs = GetPrivateProfileInt("MQ2Medley", "QueueTTL", 0, INIFileName) * 1000;
 	// FIXME: Narrowing conversion
 	WritePrivateProfileInt("MQ2Medley", "Delay", castPadTimeMs/100, INIFileName);
 	quiet = GetPrivateProfileInt("MQ2Medley", "Quiet", 0, INIFileName) ? 1 : 0;
 	WritePrivateProfileInt("MQ2Medley", "Quiet", quiet, INIFileName);
 	DebugMode = GetPrivateProfileInt("MQ2Medley", "Debug", 0, INIFileName) ? 1 : 0;
 	WritePrivateProfileInt("MQ2Medley", "Debug", DebugMode, INIFileName);
+	bNativeCast = GetPrivateProfileInt("MQ2Medley", "NativeCast", 1, INIFileName) != 0;
+	GetPrivateProfileString("MQ2Medley", "SwapGems", "", szTemp, MAX_STRING, INIFileName);
+	parseSwapGems(szTemp);
+	GetPrivateProfileString("MQ2Medley", "CoordinateChannel", "", CoordinateChannel, BLACKBOARD_NAME_LEN, INIFileName);
+	setCoordinate(GetPrivateProfileInt("MQ2Medley", "Coordinate", 0, INIFileName) != 0);
 	GetPrivateProfileString("MQ2Medley", "Medley", "", szTemp, MAX_STRING, INIFileName);
 	if (szTemp[0] != 0)
 	{
-		Load_MQ2Medley_INI_Medley(pCharInfo, szTemp);
-		bTwist = GetPrivateProfileInt("MQ2Medley", "Playing", 1, INIFileName) ? 1 : 0;
+		Load_MQ2Medley_INI_Medley(pCharInfo, szTemp, GetPrivateProfileInt("MQ2Medley", "Playing", 1, INIFileName) != 0);
 	}
 }
 
-void Load_MQ2Medley_INI_Medley(PCHARINFO pCharInfo, const std::string& medleyNameIni)
+/**
+* Medleys are read on a worker thread and swapped in by OnPulse.
+*
+* readMedleyDefinition only touches the INI file and its arguments, so it is safe to run off the
+* game thread.  Resolving names needs game data, so that and the swap happen in applyPendingMedley
+* on the next pulse after the read finishes.  Until then the old medley keeps playing.
+*/
+MedleyDefinition readMedleyDefinition(std::string iniFile, std::string medleyNameIni, bool play)
 {
 	char szTemp[MAX_STRING] = { 0 };
 	char *pNext;
 
-	medley.clear();
-	Update_INIFileName(pCharInfo);
+	MedleyDefinition def;
+	def.name = medleyNameIni;
+	def.play = play;
 
 	std::string iniSection = "MQ2Medley-" + medleyNameIni;
 	for (int i = 0; i < MAX_MEDLEY_SIZE; i++)
 	{
 		std::string iniKey = "song" + std::to_string(i + 1);
-		if (GetPrivateProfileString(iniSection.c_str(), iniKey.c_str(), "", szTemp, MAX_STRING, INIFileName))
-		{
-			SongData medleySong = nullSong;
+		if (!GetPrivateProfileString(iniSection.c_str(), iniKey.c_str(), "", szTemp, MAX_STRING, iniFile.c_str()))
+			continue;
 
-			//ugly ass split logic, example: song1=War March of Jocelyn^180.0^${Melee.Combat}
-			char *p = strtok_s(szTemp, "^", &pNext);
-			if (p)
+		//ugly ass split logic, example: song1=War March of Jocelyn^180.0^${Melee.Combat}
+		char *p = strtok_s(szTemp, "^", &pNext);
+		if (!p)
+			continue;
+		MedleyEntryDef entry;
+		entry.name = p;
+		if (p = strtok_s(nullptr, "^", &pNext))
+		{
+			entry.durationExp = p;
+			entry.hasDurationExp = true;
+			if (p = strtok_s(nullptr, "^", &pNext))
 			{
-				medleySong = getSongData(p);
-				if (medleySong.type == SongData::NOT_FOUND) {
-					WriteChatf("MQ2Medley::loadMedley - [%s] could not find song named \"%s\"", medleyNameIni.c_str(), p);
-					continue;
-				}
-				if (p = strtok_s(nullptr, "^",&pNext))
+				entry.conditionalExp = p;
+				if (p = strtok_s(nullptr, "^", &pNext))
 				{
-					medleySong.durationExp = p;
-					if (p = strtok_s(nullptr, "^", &pNext))
-					{
-						medleySong.conditionalExp = p;
-						if (p = strtok_s(nullptr, "^", &pNext))
-						{
-							medleySong.targetExp = p;
-						}
-					}
+					entry.targetExp = p;
 				}
 			}
+		}
+		def.entries.emplace_back(std::move(entry));
+	}
+	GetPrivateProfileString(iniSection.c_str(), "SongIF", "", szTemp, MAX_STRING, iniFile.c_str());
+	def.songIF = szTemp;
+	return def;
+}
 
-			if (medleySong.type != SongData::NOT_FOUND)
-			{
-				if (!quiet) WriteChatf("MQ2Medley::loadMedley - [%s] adding Song %s^%s^%s", medleyNameIni.c_str(), medleySong.name.c_str(), medleySong.durationExp.c_str(), medleySong.conditionalExp.c_str());
-				medley.emplace_back(medleySong);
-			}
+// start reading a medley in the background, replaces any load still in flight
+void Load_MQ2Medley_INI_Medley(PCHARINFO pCharInfo, const std::string& medleyNameIni, bool play)
+{
+	Update_INIFileName(pCharInfo);
+	// a superseded read is tiny, waiting for it here (future destructor) is cheaper than tracking it
+	pendingMedleyStops = twistStops;
+	pendingMedley = std::async(std::launch::async, readMedleyDefinition, std::string(INIFileName), medleyNameIni, play);
+}
+
+// A medley entry's duration changed on reload.  Move the expiry of what is already up by the
+// difference, as if it had been cast with the new duration.
+void adjustSongExpires(const SongDescriptor& previous, const SongDescriptor& updated)
+{
+	if (previous.durationExp == updated.durationExp && previous.hasDurationExp == updated.hasDurationExp)
+		return;
+	const int64_t deltaMs = static_cast<int64_t>((updated.evalDuration() - previous.evalDuration()) * 1000);
+	if (!deltaMs)
+		return;
+
+	const uint64_t now = MQGetTickCount64();
+	auto adjust = [&](uint64_t& expires) {
+		if (expires <= now)
+			return;
+		expires = static_cast<uint64_t>(std::max<int64_t>(static_cast<int64_t>(now), static_cast<int64_t>(expires) + deltaMs));
+	};
+	if (updated.isDot) {
+		for (auto& mob : songExpiresMob) {
+			auto it = mob.second.find(updated.name);
+			if (it != mob.second.end())
+				adjust(it->second);
 		}
 	}
-	WriteChatf("MQ2Medley::loadMedley - [%s] %d song Medley loaded", medleyNameIni.c_str(), static_cast<int>(medley.size()));
-	GetPrivateProfileString(iniSection.c_str(), "SongIF", "", SongIF, MAX_STRING, INIFileName);
+	else {
+		auto it = songExpires.find(updated.name);
+		if (it != songExpires.end())
+			adjust(it->second);
+	}
+	DebugSpew("MQ2Medley::adjustSongExpires %s moved by %lld ms", updated.name.c_str(), deltaMs);
+}
+
+/**
+* Feasibility
+*
+* Worked out when a medley is loaded.  Singing every song once takes the cycle time, the sum of
+* cast times plus Delay.  To stay up a song needs one cast per duration, less the 3 s early recast
+* scheduleNextSong does, and the sum of those shares of our time is the utilization.  Over 100%
+* the medley can't keep every song up, coverage is how much of it we can, and the bottleneck songs
+* are the ones that wear off before a full cycle comes back around.  Conditions are assumed to be
+* met, so a medley with situational songs may do better than this.
+*/
+struct MedleyFeasibility
+{
+	double cycleMs = 0;
+	double utilization = 0;     // 1.0 = singing all the time
+	double coverage = 1;        // share of song uptime we can sustain
+	std::string bottleneck;     // comma separated, empty if none
+};
+MedleyFeasibility feasibility;
+
+void analyzeMedley(bool report)
+{
+	struct SongLoad {
+		const SongDescriptor* desc;
+		double periodMs;
+		double share;
+	};
+	std::vector<SongLoad> loads;
+	std::string noDuration;
+
+	feasibility = MedleyFeasibility();
+	for (const SongData& song : medley)
+	{
+		const double slotMs = song.desc->getCastTimeMs() + castPadTimeMs;
+		const double durationMs = song.desc->evalDuration() * 1000.0;
+		feasibility.cycleMs += slotMs;
+		if (durationMs <= 0) {
+			// always due, it takes whatever time is left
+			noDuration += (noDuration.empty() ? "" : ", ") + song.desc->name;
+			continue;
+		}
+		const double periodMs = std::max(durationMs - 3000.0, slotMs);
+		loads.push_back({ song.desc.get(), periodMs, slotMs / periodMs });
+		feasibility.utilization += slotMs / periodMs;
+	}
+
+	if (feasibility.utilization > 1.0) {
+		feasibility.coverage = 1.0 / feasibility.utilization;
+		std::sort(loads.begin(), loads.end(), [](const SongLoad& a, const SongLoad& b) { return a.share > b.share; });
+		for (const SongLoad& load : loads)
+		{
+			if (load.periodMs < feasibility.cycleMs)
+				feasibility.bottleneck += (feasibility.bottleneck.empty() ? "" : ", ") + load.desc->name;
+		}
+		if (feasibility.bottleneck.empty() && !loads.empty())
+			feasibility.bottleneck = loads.front().desc->name;
+	}
+
+	if (!report)
+		return;
+	WriteChatf("MQ2Medley::loadMedley - [%s] cycle %.1f s, utilization %.0f%%", medleyName.c_str(), feasibility.cycleMs / 1000.0, feasibility.utilization * 100.0);
+	if (feasibility.utilization > 1.0)
+		WriteChatf(PLUGIN_MSG "\ay[%s] can keep only %.0f%% of its songs up, bottleneck: \at%s", medleyName.c_str(), feasibility.coverage * 100.0, feasibility.bottleneck.c_str());
+	if (!noDuration.empty())
+		WriteChatf(PLUGIN_MSG "\ay[%s] no duration, cast whenever nothing else is due: \at%s", medleyName.c_str(), noDuration.c_str());
+}
+
+// resolve and swap in a finished background read, game thread only
+void applyPendingMedley()
+{
+	if (!pendingMedley.valid() || pendingMedley.wait_for(std::chrono::seconds(0)) != std::future_status::ready)
+		return;
+
+	MEDLEY_ALLOCATION_EXPECTED();
+	const MedleyDefinition def = pendingMedley.get();
+	const char* medleyNameIni = def.name.c_str();
+
+	// entries that didn't change keep their descriptor, so nothing about them is resolved again
+	std::map<std::string, SongHandle> previousByKey;
+	std::map<std::string, SongHandle, ci_less> previousByName;
+	for (const SongData& song : medley) {
+		previousByKey[song.desc->entryKey()] = song.desc;
+		previousByName[song.desc->entryName] = song.desc;
+	}
+
+	std::list<SongData> newMedley;
+	SongResolver resolver(def.name);
+	int kept = 0, changed = 0, added = 0;
+	for (const MedleyEntryDef& entry : def.entries)
+	{
+		auto same = previousByKey.find(entry.key());
+		// a gem number stands for whatever is memorized there now
+		if (same != previousByKey.end() && !GetIntFromString(entry.name, 0)) {
+			newMedley.emplace_back(same->second);
+			previousByName.erase(entry.name);
+			kept++;
+			continue;
+		}
+
+		std::shared_ptr<SongDescriptor> medleySong = resolver.resolve(entry.name.c_str());
+		if (!medleySong) {
+			WriteChatf("MQ2Medley::loadMedley - [%s] could not find song named \"%s\"", medleyNameIni, entry.name.c_str());
+			continue;
+		}
+		medleySong->entryName = entry.name;
+		medleySong->durationExp = entry.durationExp;
+		medleySong->hasDurationExp = entry.hasDurationExp;
+		medleySong->conditionalExp = entry.conditionalExp;
+		medleySong->targetExp = entry.targetExp;
+		medleySong->compile();
+
+		auto previous = previousByName.find(entry.name);
+		if (previous != previousByName.end()) {
+			adjustSongExpires(*previous->second, *medleySong);
+			// the song being sung finishes with the new duration
+			if (currentSong.desc == previous->second)
+				currentSong.desc = medleySong;
+			previousByName.erase(previous);
+			changed++;
+		}
+		else
+			added++;
+		if (!quiet) WriteChatf("MQ2Medley::loadMedley - [%s] adding Song %s^%s^%s", medleyNameIni, medleySong->name.c_str(), medleySong->durationExp.c_str(), medleySong->conditionalExp.c_str());
+		newMedley.emplace_back(std::move(medleySong));
+	}
+	const int removed = static_cast<int>(previousByName.size());
+
+	medley.swap(newMedley);
+	medleyGeneration++;
+	resetQueueResolver();
+	medleyName = def.name;
+	strncpy_s(SongIF, def.songIF.c_str(), _TRUNCATE);
+	// a /medley stop while the read was running wins over the load's play
+	if (def.play && pendingMedleyStops == twistStops)
+		bTwist = true;
+	WriteChatf("MQ2Medley::loadMedley - [%s] %d song Medley loaded", medleyNameIni, static_cast<int>(medley.size()));
+	if (kept || changed)
+		WriteChatf("MQ2Medley::loadMedley - [%s] %d kept, %d changed, %d added, %d removed", medleyNameIni, kept, changed, added, removed);
+	analyzeMedley(!medley.empty());
+	// publish the new medley on the next pulse
+	blackboardHeartbeat = 0;
 }
 
 
@@ -497,7 +2054,9 @@ void StopTwistCommand(PSPAWNINFO pChar, PCHAR szLine)
 	char szTemp[MAX_STRING] = { 0 };
 	GetArg(szTemp, szLine, 1);
 	bTwist = false;
-	currentSong = nullSong;
+	twistStops++;
+	currentSong.clear();
+	cancelBurst();
 	MQ2MedleyDoCommand("/stopsong");
 	if (_strnicmp(szTemp, "silent", 6))
 		WriteChatf(PLUGIN_MSG "\atStopping Medley");
@@ -506,10 +2065,409 @@ void StopTwistCommand(PSPAWNINFO pChar, PCHAR szLine)
 
 
 
+// Add song to the once queue.  A song already queued for the same target is merged into the new
+// request instead of being queued twice.
+void queueOnce(const SongData& song)
+{
+	SongData queued = song;
+	for (auto existing = onceQueue.begin(); existing != onceQueue.end(); existing++) {
+		if (existing->targetID == song.targetID && !_stricmp(existing->desc->name.c_str(), song.desc->name.c_str())) {
+			DebugSpew("MQ2Medley::queueOnce - %s already queued, merging", song.desc->name.c_str());
+			queued.priority = std::max(existing->priority, song.priority);
+			queued.queuedMs = existing->queuedMs;
+			onceQueue.erase(existing);
+			break;
+		}
+	}
+
+	auto position = onceQueue.begin();
+	while (position != onceQueue.end() && position->priority >= queued.priority)
+		position++;
+	onceQueue.insert(position, queued);
+}
+
+// stop the song being sung so the scheduler picks again on the next pulse
+void interruptCurrentSong()
+{
+	currentSong.clear();
+	CastDue = 0;
+	MQ2MedleyDoCommand("/stopsong");
+	castEvent = CastEvent::None;
+	if (medleyState == MedleyState::Casting || medleyState == MedleyState::Recovering)
+		setMedleyState(MedleyState::Scheduling);
+}
+
+// Resolve name and queue it to cast once.  ttlMs MEDLEY_TTL_DEFAULT uses QueueTTL, MEDLEY_TTL_NONE
+// never drops it.  Shared by /medley queue and the exported API.
+bool enqueueSong(const char* name, unsigned int targetID, int priority, uint32_t ttlMs, bool interrupt)
+{
+	std::shared_ptr<SongDescriptor> queuedSong = getSongData(name);
+	if (!queuedSong) {
+		WriteChatf(PLUGIN_MSG "\atUnable to find spell for \"%s\", skipping", name);
+		return false;
+	}
+	queuedSong->compile();
+
+	SongData songData(std::move(queuedSong));
+	songData.once = true;
+	songData.targetID = targetID;
+	songData.priority = priority;
+	songData.queuedMs = MQGetTickCount64();
+	if (ttlMs == MEDLEY_TTL_DEFAULT)
+		ttlMs = defaultQueueTTLMs;
+	songData.deadlineMs = ttlMs != MEDLEY_TTL_NONE && ttlMs > 0 ? songData.queuedMs + ttlMs : 0;
+
+	if (interrupt)
+		interruptCurrentSong();
+
+	DebugSpew("MQ2Medley::enqueueSong  - queueOnce(%s);", songData.desc->name.c_str());
+	queueOnce(songData);
+	return true;
+}
+
+// Resolve names and replace the burst with them, see Burst
+bool queueBurst(const std::vector<std::string>& names, bool interrupt)
+{
+	SongResolver resolver("burst");
+	std::list<SongData> actions;
+	for (const std::string& name : names) {
+		std::shared_ptr<SongDescriptor> action = resolver.resolve(name.c_str());
+		if (!action) {
+			WriteChatf(PLUGIN_MSG "\atUnable to find spell for \"%s\", burst not queued", name.c_str());
+			return false;
+		}
+		if (!isSongMemorized(*action)) {
+			WriteChatf(PLUGIN_MSG "\at%s is not memorized, burst not queued", action->name.c_str());
+			return false;
+		}
+		action->compile();
+		SongData songData(std::move(action));
+		songData.once = true;
+		actions.push_back(std::move(songData));
+	}
+	if (actions.empty())
+		return false;
+	if (!burstQueue.empty() && !quiet)
+		WriteChatf(PLUGIN_MSG "\ayReplacing the unfinished burst");
+
+	cancelBurst();
+	burstQueue = std::move(actions);
+	burstQueuedMs = MQGetTickCount64();
+	if (interrupt && (medleyState == MedleyState::Casting || medleyState == MedleyState::Recovering))
+		interruptCurrentSong();
+	return true;
+}
+
+// the burst is done, record how long it took
+void finishBurst()
+{
+	if (burstStartMs) {
+		burstLastMs = std::max(burstNextMs, burstLastFiredMs) - burstStartMs;
+		burstCount++;
+		burstTotalMs += burstLastMs;
+		burstMaxMs = std::max(burstMaxMs, burstLastMs);
+		if (!quiet) WriteChatf(PLUGIN_MSG "\atBurst of \ag%u\at actions done in \ag%I64u\at ms, first fired \ag%I64u\at ms after queueing%s",
+			burstFired, burstLastMs, burstStartMs - burstQueuedMs, burstSkipped ? ", some were skipped" : "");
+	}
+	cancelBurst();
+}
+
+// true if a queued song should be dropped without casting it: past its deadline, or its target
+// is gone or dead
+bool isQueuedSongStale(const SongData& song, uint64_t now)
+{
+	if (song.deadlineMs && now > song.deadlineMs) {
+		DebugSpew("MQ2Medley::isQueuedSongStale - %s missed its deadline", song.desc->name.c_str());
+		return true;
+	}
+	if (song.targetID) {
+		PSPAWNINFO pSpawn = (PSPAWNINFO)GetSpawnByID(song.targetID);
+		if (!pSpawn || pSpawn->Type == SPAWN_CORPSE) {
+			DebugSpew("MQ2Medley::isQueuedSongStale - %s target %d is gone", song.desc->name.c_str(), song.targetID);
+			return true;
+		}
+	}
+	return false;
+}
+
+/**
+* Group coverage
+*
+* A group song only lands on the members in its range when it lands, so songExpires says nothing
+* about the tank running ahead.  A member counts as covered as long as getSongExpires covers the
+* song, which includes other bards on the blackboard, unless our last cast landed without them in
+* range or the target window showed otherwise while they were our target.  Members out of range
+* now can't be helped and don't count as missing, ones in range whose song is due do, and the
+* scheduler refreshes the song missing from the most of them before falling back to the stalest
+* song.  A song the window shows missing although it just landed on them (stacking, blocked
+* buffs) isn't counted missing for them again until it would have worn off.
+*/
+constexpr uint64_t MEMBER_BUFFS_SETTLE_MS = 1000;     // target window buffs before this may not be loaded yet
+struct MemberSong
+{
+	uint64_t expiresMs = 0;         // when it wears off on them, only used if missed or observed
+	uint64_t landedMs = 0;          // our last cast landed on them
+	uint64_t backoffUntilMs = 0;    // not counted missing until then
+	bool missed = false;            // our last cast landed without them in range
+	bool observed = false;          // expiresMs was read off the target window
+};
+std::map<std::string, std::map<std::string, MemberSong>, ci_less> memberSongs;   // [member][song]
+unsigned int memberTargetID = 0;
+uint64_t memberTargetSinceMs = 0;
+
+// range the song reaches group members in, 0 if it isn't a group song
+float SongDescriptor::groupRange() const
+{
+	PSPELL pSpell = spellID ? GetSpellByID(spellID) : nullptr;
+	if (!pSpell || (pSpell->TargetType != TargetType_Group_v1 && pSpell->TargetType != TargetType_Group_v2))
+		return 0;
+	return pSpell->AERange;
+}
+
+// calls fn with each group member in zone, not us
+template <typename Fn>
+void forEachGroupMember(Fn&& fn)
+{
+	PCHARINFO pCharInfo = GetCharInfo();
+	if (!pCharInfo || !pCharInfo->pSpawn || !pCharInfo->Group)
+		return;
+	for (int i = 1; i < MAX_GROUP_SIZE; i++) {
+		CGroupMember* pMember = pCharInfo->Group->GetGroupMember(i);
+		PSPAWNINFO pSpawn = pMember ? pMember->GetPlayer() : nullptr;
+		if (pSpawn && pSpawn != pCharInfo->pSpawn)
+			fn(pSpawn);
+	}
+}
+
+bool inSongRange(PSPAWNINFO pSpawn, float range)
+{
+	PCHARINFO pCharInfo = GetCharInfo();
+	return pCharInfo && pCharInfo->pSpawn && pSpawn->Type != SPAWN_CORPSE && Distance3DToSpawn(pCharInfo->pSpawn, pSpawn) <= range;
+}
+
+// null if nothing is known about song on member beyond getSongExpires
+const MemberSong* findMemberSong(const char* member, const SongDescriptor& song)
+{
+	auto songs = memberSongs.find(member);
+	if (songs == memberSongs.end())
+		return nullptr;
+	auto tracked = songs->second.find(song.name);
+	return tracked == songs->second.end() ? nullptr : &tracked->second;
+}
+
+MemberSong& trackMemberSong(const char* member, const SongDescriptor& song)
+{
+	if (!findMemberSong(member, song))
+		MEDLEY_ALLOCATION_EXPECTED();
+	return memberSongs[member][song.name];
+}
+
+uint64_t getMemberExpires(const char* member, const SongDescriptor& song)
+{
+	const MemberSong* tracked = findMemberSong(member, song);
+	if (!tracked || !(tracked->missed || tracked->observed))
+		return getSongExpires(song);
+	if (tracked->observed)
+		return tracked->expiresMs;
+	// we missed them, another bard may not have
+	const uint64_t covered = bCoordinate && pBlackboard ? blackboardCoveredUntil(song.name) : 0;
+	return std::max(tracked->expiresMs, covered);
+}
+
+// our cast of song landed, everyone in range has it until expiresMs.  previousMs is when it was
+// going to wear off before, which still holds for the ones out of range.
+void songReachedGroup(const SongDescriptor& song, uint64_t previousMs, uint64_t expiresMs)
+{
+	const float range = song.groupRange();
+	if (range <= 0)
+		return;
+	const uint64_t now = MQGetTickCount64();
+	forEachGroupMember([&](PSPAWNINFO pSpawn) {
+		if (inSongRange(pSpawn, range)) {
+			MemberSong& landed = trackMemberSong(pSpawn->Name, song);
+			landed.expiresMs = expiresMs;
+			landed.landedMs = now;
+			landed.missed = landed.observed = false;
+			return;
+		}
+		DebugSpew("MQ2Medley::songReachedGroup - %s out of range for %s", pSpawn->Name, song.name.c_str());
+		MemberSong& missed = trackMemberSong(pSpawn->Name, song);
+		if (!missed.missed && !missed.observed)
+			missed.expiresMs = previousMs;
+		missed.missed = true;
+		missed.observed = false;
+	});
+}
+
+// members in range now that the song is due on
+int missingMembers(const SongDescriptor& song, uint64_t atMs)
+{
+	const float range = song.groupRange();
+	if (range <= 0)
+		return 0;
+	int missing = 0;
+	forEachGroupMember([&](PSPAWNINFO pSpawn) {
+		if (!inSongRange(pSpawn, range))
+			return;
+		const MemberSong* tracked = findMemberSong(pSpawn->Name, song);
+		if (tracked && tracked->backoffUntilMs > atMs)
+			return;
+		if (getMemberExpires(pSpawn->Name, song) < atMs + song.getCastTimeMs() + 3000)
+			missing++;
+	});
+	return missing;
+}
+
+// the group song missing from the most members in range, null if none is
+const SongData* mostMissingSong(uint64_t atMs)
+{
+	const SongData* best = nullptr;
+	int bestMissing = 0;
+	for (const SongData& song : medley) {
+		const int missing = missingMembers(*song.desc, atMs);
+		if (missing > bestMissing) {
+			best = &song;
+			bestMissing = missing;
+		}
+	}
+	return best;
+}
+
+// while a group member is our target, read the medley's songs off the target window
+void observeMemberBuffs()
+{
+	const uint64_t now = MQGetTickCount64();
+	PSPAWNINFO pMember = nullptr;
+	if (pTarget && pTargetWnd) {
+		forEachGroupMember([&](PSPAWNINFO pSpawn) {
+			if (pSpawn == pTarget)
+				pMember = pSpawn;
+		});
+	}
+	if (!pMember) {
+		memberTargetID = 0;
+		return;
+	}
+	if (pMember->SpawnID != memberTargetID) {
+		memberTargetID = pMember->SpawnID;
+		memberTargetSinceMs = now;
+	}
+	if (now < memberTargetSinceMs + MEMBER_BUFFS_SETTLE_MS)
+		return;
+
+	bool anyBuffs = false;
+	for (int buffID : pTargetWnd->BuffSpellID)
+		anyBuffs |= buffID > 0;
+	for (const SongData& song : medley) {
+		const SongDescriptor& desc = *song.desc;
+		if (!desc.spellID || desc.groupRange() <= 0)
+			continue;
+		int slot = -1;
+		for (int i = 0; i < static_cast<int>(std::size(pTargetWnd->BuffSpellID)); i++) {
+			if (pTargetWnd->BuffSpellID[i] == desc.spellID) {
+				slot = i;
+				break;
+			}
+		}
+		if (slot >= 0) {
+			MemberSong& tracked = trackMemberSong(pMember->Name, desc);
+			tracked.expiresMs = now + pTargetWnd->BuffTimer[slot];
+			tracked.observed = true;
+			tracked.missed = false;
+			tracked.backoffUntilMs = 0;
+			continue;
+		}
+		// only trust a missing song once the window shows buffs at all, and only change what we
+		// know once, not every pulse
+		const uint64_t expires = getMemberExpires(pMember->Name, desc);
+		if (!anyBuffs || expires <= now)
+			continue;
+		MemberSong& tracked = trackMemberSong(pMember->Name, desc);
+		if (tracked.landedMs && now < tracked.landedMs + BUFF_LAND_MS)
+			continue;
+		if (tracked.landedMs && !tracked.missed && !tracked.observed) {
+			// it landed on them and didn't stick, recasting won't help until it would have worn off
+			DebugSpew("MQ2Medley::observeMemberBuffs - %s didn't stick on %s", desc.name.c_str(), pMember->Name);
+			tracked.backoffUntilMs = expires;
+		}
+		tracked.expiresMs = now;
+		tracked.observed = true;
+		tracked.missed = false;
+	}
+}
+
+// % of the medley's group songs up on member, -1 if there are none
+double memberCoverage(const char* member, std::string* missing)
+{
+	const uint64_t now = MQGetTickCount64();
+	int songs = 0;
+	int up = 0;
+	for (const SongData& song : medley) {
+		if (song.desc->groupRange() <= 0)
+			continue;
+		songs++;
+		if (getMemberExpires(member, *song.desc) > now)
+			up++;
+		else if (missing)
+			*missing += (missing->empty() ? "" : ", ") + song.desc->name;
+	}
+	return songs ? up * 100.0 / songs : -1;
+}
+
+void DisplayMedleyStats() {
+	WriteChatf(PLUGIN_MSG "\atState \ag%s\at for \ag%I64u\at ms", MedleyStateNames[static_cast<int>(medleyState)], stateEnteredMs ? MQGetTickCount64() - stateEnteredMs : 0);
+	for (int from = 0; from < MEDLEY_STATE_COUNT; from++) {
+		for (int to = 0; to < MEDLEY_STATE_COUNT; to++) {
+			if (stateTransitions[from][to])
+				WriteChatf(PLUGIN_MSG "\at  %s -> %s: \ag%u", MedleyStateNames[from], MedleyStateNames[to], stateTransitions[from][to]);
+		}
+	}
+	for (int i = 0; i < MEDLEY_STATE_COUNT; i++) {
+		if (stateTimeMs[i])
+			WriteChatf(PLUGIN_MSG "\at  time in %s: \ag%I64u\at ms", MedleyStateNames[i], stateTimeMs[i]);
+	}
+	if (queueDropped)
+		WriteChatf(PLUGIN_MSG "\atStale queued songs dropped \ag%u", queueDropped);
+	if (memorizeCount || memorizeFailures)
+		WriteChatf(PLUGIN_MSG "\atSongs memorized \ag%u\at, failed \ag%u\at, cost \ag%I64u\at ms", memorizeCount, memorizeFailures, memorizeCostMs);
+#ifdef MEDLEY_ALLOC_COUNT
+	WriteChatf(PLUGIN_MSG "\atAllocation check: \ag%u\at pulses checked, %s%u\at allocated, \ag%u\at expected to",
+		allocPulsesChecked, allocPulsesFailed ? "\ar" : "\ag", allocPulsesFailed, allocPulsesExempt);
+#endif
+	if (castsSuppressed)
+		WriteChatf(PLUGIN_MSG "\atSongs held back for immune, resisting or out of range targets \ag%u", castsSuppressed);
+	if (speculativeHits || speculativeMisses)
+		WriteChatf(PLUGIN_MSG "\atPre-evaluated next song used \ag%u\at times, rescheduled \ag%u\at times", speculativeHits, speculativeMisses);
+	if (targetSwapCount)
+		WriteChatf(PLUGIN_MSG "\atTarget swaps \ag%u\at, avg \ag%I64u\at ms, max \ag%I64u\at ms, last \ag%I64u\at ms, timeouts \ag%u",
+			targetSwapCount, targetSwapTotalMs / targetSwapCount, targetSwapMaxMs, targetSwapLastMs, targetSwapTimeouts);
+	for (int i = 0; i < static_cast<int>(DispatchPath::Count); i++) {
+		const DispatchStats& stats = dispatchStats[i];
+		if (stats.count)
+			WriteChatf(PLUGIN_MSG "\atCast dispatch %s \ag%u\at, avg \ag%I64u\at us, max \ag%I64u\at us",
+				DispatchPathNames[i], stats.count, stats.totalUs / stats.count, stats.maxUs);
+	}
+	for (int i = 0; i < static_cast<int>(Detection::Count); i++) {
+		const DetectionStats& stats = detectionStats[i];
+		if (stats.count)
+			WriteChatf(PLUGIN_MSG "\atCast %s \ag%u\at, avg \ag%lld\at ms, max \ag%lld\at ms",
+				DetectionNames[i], stats.count, stats.totalMs / stats.count, stats.maxMs);
+	}
+	if (chatInterruptsFirst)
+		WriteChatf(PLUGIN_MSG "\atInterrupts chat reported first \ag%u", chatInterruptsFirst);
+	if (burstCount)
+		WriteChatf(PLUGIN_MSG "\atBursts \ag%u\at, avg \ag%I64u\at ms, max \ag%I64u\at ms, last \ag%I64u\at ms",
+			burstCount, burstTotalMs / burstCount, burstMaxMs, burstLastMs);
+}
+
 void DisplayMedleyHelp() {
 	WriteChatf("\arMQ2Medley \au- \atSong Scheduler - read documentation online");
 }
 
+// /medley bench, see runBenchmarks
+constexpr int BENCH_DEFAULT_ITERATIONS = 1000;
+void runBenchmarks(int iterations);
+
 // **************************************************  *************************
 // Function:      MedleyCommand
 // Description:   Our /medley command. schedule songs to sing
@@ -521,7 +2479,7 @@ void MedleyCommand(PSPAWNINFO pChar, PCHAR szLine)
 	int argNum = 1;
 	GetArg(szTemp, szLine, argNum);
 
-	if ((!medley.empty() && (!strlen(szTemp)) || !_strnicmp(szTemp, "start", 5))) {
+	if (((!medley.empty() || !onceQueue.empty()) && (!strlen(szTemp)) || !_strnicmp(szTemp, "start", 5))) {
 		GetArg(szTemp1, szLine, 2);
 		if (_strnicmp(szTemp1, "silent", 6))
 			WriteChatf(PLUGIN_MSG "\atStarting Twist.");
@@ -563,6 +2521,7 @@ void MedleyCommand(PSPAWNINFO pChar, PCHAR szLine)
 				delay = 0;
 			}
 			castPadTimeMs = delay * 100;
+			analyzeMedley(false);
 			Update_INIFileName(GetCharInfo());
 			WritePrivateProfileInt("MQ2Medley", "Delay", delay, INIFileName);
 			WriteChatf(PLUGIN_MSG "\atSet delay to \ag%d\at, INI updated.", delay);
@@ -579,6 +2538,130 @@ void MedleyCommand(PSPAWNINFO pChar, PCHAR szLine)
 		return;
 	}
 
+	if (!_strnicmp(szTemp, "stats", 5)) {
+		GetArg(szTemp, szLine, 2);
+		if (!_stricmp(szTemp, "reset")) {
+			memset(stateTransitions, 0, sizeof(stateTransitions));
+			memset(stateTimeMs, 0, sizeof(stateTimeMs));
+			targetSwapCount = targetSwapTimeouts = 0;
+			queueDropped = 0;
+			speculativeHits = speculativeMisses = 0;
+			castsSuppressed = 0;
+			memorizeCount = memorizeFailures = 0;
+#ifdef MEDLEY_ALLOC_COUNT
+			allocPulsesChecked = allocPulsesFailed = allocPulsesExempt = 0;
+#endif
+			targetSwapTotalMs = targetSwapMaxMs = targetSwapLastMs = 0;
+			for (DispatchStats& stats : dispatchStats)
+				stats = DispatchStats();
+			for (DetectionStats& stats : detectionStats)
+				stats = DetectionStats();
+			chatInterruptsFirst = 0;
+			burstCount = 0;
+			burstTotalMs = burstMaxMs = burstLastMs = 0;
+			stateEnteredMs = MQGetTickCount64();
+			WriteChatf(PLUGIN_MSG "\atStats reset.");
+		}
+		else
+			DisplayMedleyStats();
+		return;
+	}
+
+	if (!_strnicmp(szTemp, "analyze", 7)) {
+		if (medley.empty())
+			WriteChatf(PLUGIN_MSG "\atNo medley defined");
+		else
+			analyzeMedley(true);
+		return;
+	}
+
+	if (!_strnicmp(szTemp, "bench", 5)) {
+		GetArg(szTemp, szLine, 2);
+		const int iterations = GetIntFromString(szTemp, BENCH_DEFAULT_ITERATIONS);
+		runBenchmarks(iterations > 0 ? iterations : BENCH_DEFAULT_ITERATIONS);
+		return;
+	}
+
+	if (!_strnicmp(szTemp, "immune", 6)) {
+		GetArg(szTemp, szLine, 2);
+		if (!_stricmp(szTemp, "clear")) {
+			WritePrivateProfileString(currentZoneShortName(), nullptr, nullptr, ImmuneIniFileName);
+			immuneByName.clear();
+			spawnOutcomes.clear();
+			WriteChatf(PLUGIN_MSG "\atForgot immunities learned in %s.", currentZoneShortName());
+			return;
+		}
+		if (immuneByName.empty())
+			WriteChatf(PLUGIN_MSG "\atNo immunities learned in %s.", currentZoneShortName());
+		for (const auto& mob : immuneByName) {
+			std::string songs;
+			for (const std::string& song : mob.second)
+				songs += (songs.empty() ? "" : ", ") + song;
+			WriteChatf(PLUGIN_MSG "\at%s: \ag%s", mob.first.c_str(), songs.c_str());
+		}
+		return;
+	}
+
+	if (!_strnicmp(szTemp, "burst", 5)) {
+		std::vector<std::string> names;
+		bool interrupt = false;
+		for (int arg = 2; ; arg++) {
+			GetArg(szTemp, szLine, arg);
+			if (!szTemp[0])
+				break;
+			if (!_strnicmp(szTemp, "-interrupt", 10))
+				interrupt = true;
+			else
+				names.emplace_back(szTemp);
+		}
+		if (names.empty()) {
+			WriteChatf(PLUGIN_MSG "\atUsage: /medley burst \"aa/item/song name\" [\"name\" ...] [-interrupt]");
+			return;
+		}
+		if (queueBurst(names, interrupt) && !quiet)
+			WriteChatf(PLUGIN_MSG "\ayBurst of %d queued", static_cast<int>(names.size()));
+		return;
+	}
+
+	if (!_strnicmp(szTemp, "group", 5)) {
+		bool any = false;
+		forEachGroupMember([&](PSPAWNINFO pSpawn) {
+			std::string missing;
+			const double coverage = memberCoverage(pSpawn->Name, &missing);
+			if (coverage < 0)
+				return;
+			any = true;
+			WriteChatf(PLUGIN_MSG "\at%s: \ag%.0f%%%s%s", pSpawn->Name, coverage, missing.empty() ? "" : "\at, missing \ay", missing.c_str());
+		});
+		if (!any)
+			WriteChatf(PLUGIN_MSG "\atNo group members in zone, or no group songs in the medley.");
+		return;
+	}
+
+	if (!_strnicmp(szTemp, "coordinate", 10)) {
+		GetArg(szTemp, szLine, 2);
+		if (!_stricmp(szTemp, "on"))
+			setCoordinate(true);
+		else if (!_stricmp(szTemp, "off"))
+			setCoordinate(false);
+		else if (!strlen(szTemp))
+			setCoordinate(!bCoordinate);
+		else {
+			WriteChatf(PLUGIN_MSG "\atUsage: /medley coordinate [on|off] [channel]");
+			return;
+		}
+
+		GetArg(szTemp1, szLine, 3);
+		if (strlen(szTemp1)) {
+			strcpy_s(CoordinateChannel, szTemp1);
+			WritePrivateProfileString("MQ2Medley", "CoordinateChannel", CoordinateChannel, INIFileName);
+			blackboardHeartbeat = 0;
+		}
+		WritePrivateProfileInt("MQ2Medley", "Coordinate", bCoordinate, INIFileName);
+		WriteChatf(PLUGIN_MSG "\atCoordination is now %s\at, channel \ag\"%s\"\at, \ag%d\at bards.", bCoordinate ? "\agON" : "\ayOFF", CoordinateChannel, blackboardBardCount());
+		return;
+	}
+
 	if (!_strnicmp(szTemp, "clear", 5)) {
 		resetTwistData();
 		StopTwistCommand(pChar, szTemp);
@@ -605,11 +2688,12 @@ void MedleyCommand(PSPAWNINFO pChar, PCHAR szLine)
 			WriteChatf(PLUGIN_MSG "\atqueue requires spell/item/aa to cast", szTemp);
 			return;
 		}
-		SongData songData = getSongData(szTemp);
-		if (songData.type == SongData::NOT_FOUND) {
-			WriteChatf(PLUGIN_MSG "\atUnable to find spell for \"%s\", skipping", szTemp);
-			return;
-		}
+		char songName[MAX_STRING] = { 0 };
+		strcpy_s(songName, szTemp);
+		unsigned int targetID = 0;
+		int priority = SongData::PRIORITY_NORMAL;
+		uint32_t ttlMs = MEDLEY_TTL_DEFAULT;
+		bool interrupt = false;
 
 		do {
 			GetArg(szTemp, szLine, argNum++);
@@ -617,21 +2701,30 @@ void MedleyCommand(PSPAWNINFO pChar, PCHAR szLine)
 				break;
 			}
 			else if (!_strnicmp(szTemp, "-targetid|", 10)) {
-				songData.targetID = GetIntFromString(&szTemp[10], 0);
-				DebugSpew("MQ2Medley::TwistCommand  - queue \"%s\" targetid=%d", songData.name.c_str(), songData.targetID);
+				targetID = GetIntFromString(&szTemp[10], 0);
+				DebugSpew("MQ2Medley::TwistCommand  - queue \"%s\" targetid=%d", songName, targetID);
+			}
+			else if (!_strnicmp(szTemp, "-ttl|", 5)) {
+				ttlMs = static_cast<uint32_t>(std::clamp(GetDoubleFromString(&szTemp[5], 0.0) * 1000, 0.0, static_cast<double>(MEDLEY_TTL_NONE - 1)));
+			}
+			else if (!_strnicmp(szTemp, "-priority|", 10)) {
+				const char* priorityArg = &szTemp[10];
+				if (!_stricmp(priorityArg, "high"))
+					priority = SongData::PRIORITY_HIGH;
+				else if (!_stricmp(priorityArg, "normal"))
+					priority = SongData::PRIORITY_NORMAL;
+				else if (!_stricmp(priorityArg, "low"))
+					priority = SongData::PRIORITY_LOW;
+				else
+					priority = GetIntFromString(priorityArg, SongData::PRIORITY_NORMAL);
 			}
 			else if (!_strnicmp(szTemp, "-interrupt", 10)) {
-				currentSong = nullSong;
-				CastDue = 0;
-				MQ2MedleyDoCommand("/stopsong");
+				interrupt = true;
 			}
 
 		} while (true);
-		songData.once = true;
 
-		DebugSpew("MQ2Medley::TwistCommand  - altQueue.push_back(%s);", songData.name.c_str());
-		//altQueue.push_back(songData);
-		medley.push_front(songData);
+		enqueueSong(songName, targetID, priority, ttlMs, interrupt);
 		return;
 	}
 
@@ -667,7 +2760,7 @@ void MedleyCommand(PSPAWNINFO pChar, PCHAR szLine)
 	//		bTwist = true;
 	//	if (isInterrupt)
 	//	{
-	//		currentSong = nullSong;
+	//		currentSong.clear();
 	//		CastDue = 0;
 	//		MQ2MedleyDoCommand("/stopsong");
 	//	}
@@ -676,11 +2769,9 @@ void MedleyCommand(PSPAWNINFO pChar, PCHAR szLine)
 
 	if (strlen(szTemp)) {
 		WriteChatf(PLUGIN_MSG "\atLoading medley \"%s\"", szTemp);
-		medleyName = szTemp;
 		WritePrivateProfileString("MQ2Medley", "Medley", szTemp, INIFileName);
-		Load_MQ2Medley_INI_Medley(GetCharInfo(), medleyName);
-		bTwist = true;
-		WritePrivateProfileInt("MQ2Medley", "Playing", bTwist, INIFileName);
+		Load_MQ2Medley_INI_Medley(GetCharInfo(), szTemp, true);
+		WritePrivateProfileInt("MQ2Medley", "Playing", 1, INIFileName);
 		return;
 	}
 	else if (!medley.empty()) {
@@ -703,11 +2794,9 @@ Note 2: Since the auto-stand-on-cast bullcrap added to EQ a few patches ago,
 chars would stand up every time it tried to twist a medley.  So now
 we stop twisting at sit.
 */
-bool CheckCharState()
+// false if we can't cast now (stunned, sitting, feigned, silenced, ...), twisting or not
+bool canSing()
 {
-	if (!bTwist)
-		return false;
-
 	if (GetCharInfo()) {
 		if (!GetCharInfo()->pSpawn)
 			return false;
@@ -744,6 +2833,13 @@ bool CheckCharState()
 	return true;
 }
 
+bool CheckCharState()
+{
+	if (!bTwist)
+		return false;
+	return canSing();
+}
+
 class MQ2MedleyType *pMedleyType = 0;
 
 class MQ2MedleyType : public MQ2Type
@@ -755,7 +2851,17 @@ public:
 		Medley = 1,
 		TTQE = 2,
 		Tune = 3,
-		Active
+		Active,
+		Bards,
+		State,
+		StateCount,
+		SwapWindow,
+		Utilization,
+		Coverage,
+		CycleTime,
+		Bottleneck,
+		MemberCoverage,
+		MemberMissing
 	};
 
 	MQ2MedleyType() :MQ2Type("Medley") {
@@ -763,6 +2869,16 @@ public:
 		TypeMember(TTQE);
 		TypeMember(Tune);
 		TypeMember(Active);
+		TypeMember(Bards);
+		TypeMember(State);
+		TypeMember(StateCount);
+		TypeMember(SwapWindow);
+		TypeMember(Utilization);
+		TypeMember(Coverage);
+		TypeMember(CycleTime);
+		TypeMember(Bottleneck);
+		TypeMember(MemberCoverage);
+		TypeMember(MemberMissing);
 	}
 
 	virtual bool GetMember(MQVarPtr VarPtr, const char* Member, char* Index, MQTypeVar& Dest) override {
@@ -783,9 +2899,9 @@ public:
 			case TTQE:
 				/* Returns: double
 				0 - if nothing is queued and performing normal medley
-				#.# - double estimate time till queue is completed
+				#.# - double estimate seconds till queue is completed
 				*/
-				Dest.Double = getTimeTillQueueEmpty();
+				Dest.Double = getTimeTillQueueEmptyMs() / 1000.0;
 				Dest.Type = mq::datatypes::pDoubleType;
 				return true;
 			case Tune:
@@ -802,77 +2918,841 @@ public:
 				Dest.Int = bTwist;
 				Dest.Type = mq::datatypes::pBoolType;
 				return true;
+			case Bards:
+				/* Returns: int
+				0 - not coordinating with other bards
+				# - live bards on our coordination channel, including us
+				*/
+				Dest.Int = bCoordinate ? blackboardBardCount() : 0;
+				Dest.Type = mq::datatypes::pIntType;
+				return true;
+			case State:
+				/* Returns: string
+				Idle, Scheduling, Casting, Recovering, TargetRestore, Paused, Memorizing or Bursting
+				*/
+				strcpy_s(szTemp, MedleyStateNames[static_cast<int>(medleyState)]);
+				Dest.Ptr = szTemp;
+				Dest.Type = mq::datatypes::pStringType;
+				return true;
+			case StateCount:
+			{
+				/* Returns: int
+				number of times the state named by Index was entered
+				*/
+				const int state = findMedleyState(Index);
+				if (state < 0)
+					return false;
+				Dest.Int = 0;
+				for (int from = 0; from < MEDLEY_STATE_COUNT; from++)
+					Dest.Int += stateTransitions[from][state];
+				Dest.Type = mq::datatypes::pIntType;
+				return true;
+			}
+			case SwapWindow:
+				/* Returns: int
+				ms the target was borrowed for the last queued song with a target, 0 if none yet
+				*/
+				Dest.Int = static_cast<int>(targetSwapLastMs);
+				Dest.Type = mq::datatypes::pIntType;
+				return true;
+			case Utilization:
+				/* Returns: double
+				% of our time the medley needs to keep every song up, over 100 can't be sustained
+				*/
+				Dest.Double = feasibility.utilization * 100.0;
+				Dest.Type = mq::datatypes::pDoubleType;
+				return true;
+			case Coverage:
+				/* Returns: double
+				% of song uptime the medley can sustain, 100 if it can keep every song up
+				*/
+				Dest.Double = feasibility.coverage * 100.0;
+				Dest.Type = mq::datatypes::pDoubleType;
+				return true;
+			case CycleTime:
+				/* Returns: double
+				seconds to sing every song in the medley once, Delay included
+				*/
+				Dest.Double = feasibility.cycleMs / 1000.0;
+				Dest.Type = mq::datatypes::pDoubleType;
+				return true;
+			case Bottleneck:
+				/* Returns: string
+				songs that wear off before the medley comes back around to them, empty if none
+				*/
+				strcpy_s(szTemp, feasibility.bottleneck.c_str());
+				Dest.Ptr = szTemp;
+				Dest.Type = mq::datatypes::pStringType;
+				return true;
+			case MemberCoverage:
+			{
+				/* Returns: double
+				% of the medley's group songs up on the group member named by Index
+				*/
+				if (!Index || !Index[0])
+					return false;
+				const double coverage = memberCoverage(Index, nullptr);
+				if (coverage < 0)
+					return false;
+				Dest.Double = coverage;
+				Dest.Type = mq::datatypes::pDoubleType;
+				return true;
+			}
+			case MemberMissing:
+			{
+				/* Returns: string
+				the medley's group songs that are down on the group member named by Index
+				*/
+				if (!Index || !Index[0])
+					return false;
+				std::string missing;
+				if (memberCoverage(Index, &missing) < 0)
+					return false;
+				strcpy_s(szTemp, missing.c_str());
+				Dest.Ptr = szTemp;
+				Dest.Type = mq::datatypes::pStringType;
+				return true;
+			}
 			default:
 				break;
 		}
-		return false;
+		return false;
+	}
+
+	bool ToString(MQVarPtr VarPtr, char* Destination) override
+	{
+		strcpy_s(Destination, MAX_STRING, bTwist ? "TRUE" : "FALSE");
+		return true;
+	}
+};
+
+bool dataMedley(const char* szIndex, MQTypeVar& Dest)
+{
+	Dest.DWord = 1;
+	Dest.Type = pMedleyType;
+	return true;
+}
+
+/**
+* Exported API support, see MQ2Medley.h
+*/
+struct MedleySubscriber
+{
+	int id;
+	fMedleyCallback callback;
+	void* context;
+};
+std::vector<MedleySubscriber> medleySubscribers;
+int nextSubscriberId = 1;
+bool firingMedleyEvent = false;       // unsubscribing only clears the callback while set
+
+void fillSongInfo(const SongData& song, MedleySongInfo& info)
+{
+	memset(&info, 0, sizeof(MedleySongInfo));
+	if (song.isNull())
+		return;
+	strncpy_s(info.name, song.desc->name.c_str(), _TRUNCATE);
+	info.type = song.desc->type == SongDescriptor::NOT_FOUND ? MEDLEY_SONG_NONE : song.desc->type;
+	info.targetID = song.targetID;
+	info.castTimeMs = song.desc->getCastTimeMs();
+	info.once = song.once ? 1 : 0;
+	const uint64_t now = MQGetTickCount64();
+	const uint64_t expires = getSongExpires(*song.desc);
+	info.expiresInMs = expires > now ? static_cast<int64_t>(expires - now) : 0;
+}
+
+void fireMedleyEvent(int event, const SongData& song)
+{
+	if (medleySubscribers.empty())
+		return;
+	MedleySongInfo info;
+	fillSongInfo(song, info);
+	// by index, a callback may subscribe (it misses this event) or unsubscribe (callback cleared)
+	firingMedleyEvent = true;
+	const size_t count = medleySubscribers.size();
+	for (size_t i = 0; i < count; i++) {
+		const MedleySubscriber subscriber = medleySubscribers[i];
+		if (subscriber.callback)
+			subscriber.callback(event, &info, subscriber.context);
+	}
+	firingMedleyEvent = false;
+	medleySubscribers.erase(std::remove_if(medleySubscribers.begin(), medleySubscribers.end(),
+		[](const MedleySubscriber& subscriber) { return !subscriber.callback; }), medleySubscribers.end());
+}
+
+// Best guess at what scheduleNextSong will pick, without evaluating conditions or touching the
+// queue: the first queued song, or the medley song that expires first.
+const SongData* peekNextSong()
+{
+	if (!onceQueue.empty())
+		return &onceQueue.front();
+
+	const SongData* next = nullptr;
+	uint64_t nextExpires = 0;
+	for (const SongData& song : medley) {
+		const uint64_t expires = getSongExpires(*song.desc);
+		if (!next || expires < nextExpires) {
+			next = &song;
+			nextExpires = expires;
+		}
+	}
+	return next;
+}
+
+SongData scheduleNextSong();
+
+/**
+* Speculative pre-evaluation
+*
+* While a song is being sung OnPulse has nothing to do, so the medley's readiness and conditions
+* are evaluated then, one song per pulse.  Once all are done the song scheduleNextSong would pick
+* at CastDue is worked out, and at CastDue only that song is checked again.
+*/
+struct SongCandidate
+{
+	bool ready;      // ready to cast by CastDue
+	bool condition;  // condition was met when evaluated
+};
+std::vector<SongCandidate> candidates;        // parallel to medley
+std::list<SongData>::const_iterator preEvalSong;
+size_t preEvalIndex = 0;
+uint32_t preEvalGeneration = 0;
+bool preEvalDone = true;
+const SongData* speculativeSong = nullptr;    // into medley, valid while preEvalGeneration == medleyGeneration
+
+void startPreEvaluation()
+{
+	if (candidates.capacity() < medley.size())
+		MEDLEY_ALLOCATION_EXPECTED();
+	candidates.resize(medley.size());
+	preEvalSong = medley.cbegin();
+	preEvalIndex = 0;
+	preEvalGeneration = medleyGeneration;
+	preEvalDone = medley.empty();
+	speculativeSong = nullptr;
+}
+
+// same rules as scheduleNextSong, but from the cached evaluation and as of CastDue
+void pickSpeculativeSong()
+{
+	const uint64_t castAtMs = CastDue;
+	const SongData* stalestSong = nullptr;
+	uint64_t stalestExpires = 0;
+	size_t index = 0;
+	for (auto song = medley.cbegin(); song != medley.cend(); song++, index++)
+	{
+		// the song being sung now will be fresh by then
+		if (!currentSong.isNull() && song->desc == currentSong.desc)
+			continue;
+		if (!isSongMemorized(*song->desc)) {
+			// a song we would memorize first needs the full scheduleNextSong
+			if (canMemorize(*song->desc) && getSongExpires(*song->desc) - song->desc->getCastTimeMs() - 3000 - memorizeCostMs < castAtMs) {
+				speculativeSong = nullptr;
+				return;
+			}
+			continue;
+		}
+		if (!candidates[index].ready || !candidates[index].condition)
+			continue;
+
+		const uint64_t expires = getSongExpires(*song->desc);
+		uint64_t startCastByMs = expires - song->desc->getCastTimeMs() - 3000;
+		if (startCastByMs < castAtMs) {
+			speculativeSong = &(*song);
+			return;
+		}
+		if (!stalestSong || expires < stalestExpires) {
+			stalestSong = &(*song);
+			stalestExpires = expires;
+		}
+	}
+	// the group refresh is checked again at CastDue, positions will have changed by then
+	const SongData* groupSong = mostMissingSong(castAtMs);
+	speculativeSong = groupSong ? nullptr : stalestSong;
+}
+
+// evaluate one medley song, called on pulses spent waiting for CastDue
+void preEvaluateNextSong()
+{
+	if (preEvalDone || preEvalGeneration != medleyGeneration)
+		return;
+
+	if (preEvalSong == medley.cend()) {
+		pickSpeculativeSong();
+		preEvalDone = true;
+		if (DebugMode) WriteChatf("MQ2Medley::preEvaluateNextSong - next song will be %s", speculativeSong ? speculativeSong->desc->name.c_str() : "(none)");
+		return;
+	}
+
+	const SongDescriptor& desc = *preEvalSong->desc;
+	const int64_t readyInMs = desc.readyInMs();
+	const uint64_t now = MQGetTickCount64();
+	SongCandidate& candidate = candidates[preEvalIndex];
+	candidate.ready = readyInMs >= 0 && now + readyInMs <= CastDue;
+	candidate.condition = candidate.ready && desc.evalCondition() && !isSongBlocked(*preEvalSong, songTargetID(*preEvalSong));
+
+	preEvalSong++;
+	preEvalIndex++;
+}
+
+// the speculative song if it is still good, otherwise a full scheduleNextSong
+SongData takeNextSong()
+{
+	const bool valid = preEvalDone && speculativeSong && preEvalGeneration == medleyGeneration && onceQueue.empty();
+	const SongData* speculative = speculativeSong;
+	speculativeSong = nullptr;
+	preEvalDone = true;
+
+	if (valid && speculative->desc->isReady() && speculative->desc->evalCondition()) {
+		const unsigned int targetID = songTargetID(*speculative);
+		if (!isSongBlocked(*speculative, targetID)) {
+			speculativeHits++;
+			return withTarget(*speculative, targetID);
+		}
+	}
+	speculativeMisses++;
+	return scheduleNextSong();
+}
+
+// Picks the next song and returns it.  The result shares its descriptor with the medley or
+// queue entry, so no song strings are copied.
+SongData scheduleNextSong()
+{
+	uint64_t currentTickMs = MQGetTickCount64();
+
+	if (DebugMode) WriteChatf("MQ2Medley::scheduleNextSong - currentTickMs=%I64u", currentTickMs);
+
+	// once queue goes first, highest priority first
+	for (auto song = onceQueue.begin(); song != onceQueue.end(); )
+	{
+		const SongDescriptor& desc = *song->desc;
+		if (isQueuedSongStale(*song, currentTickMs)) {
+			if (!quiet) WriteChatf(PLUGIN_MSG "\atDropping stale queued song: %s", desc.name.c_str());
+			queueDropped++;
+			song = onceQueue.erase(song);
+			continue;
+		}
+		// a queued song that isn't memorized needs a swap gem it can go into now
+		const bool memorized = isSongMemorized(desc);
+		const bool ready = memorized ? desc.isReady() : canMemorize(desc) && pickSwapGem(currentTickMs) >= 0;
+		if (!ready) {
+			DebugSpew("MQ2Medley::scheduleNextSong skipping[%s] (not ready)", desc.name.c_str());
+			song++;
+			continue;
+		}
+		if (!desc.evalCondition()) {
+			DebugSpew("MQ2Medley::scheduleNextSong skipping[%s] (condition not met)", desc.name.c_str());
+			song++;
+			continue;
+		}
+		const unsigned int targetID = songTargetID(*song);
+		if (isSongBlocked(*song, targetID)) {
+			DebugSpew("MQ2Medley::scheduleNextSong skipping[%s] (target immune, resisting or out of range)", desc.name.c_str());
+			castsSuppressed++;
+			song++;
+			continue;
+		}
+
+		SongData nextSong = std::move(*song);
+		onceQueue.erase(song);
+		if (!nextSong.desc->targetCalc.empty())
+			nextSong.targetID = targetID;
+		return nextSong;
+	}
+
+	const SongData* stalestSong = nullptr;
+	uint64_t stalestExpires = 0;
+	unsigned int stalestTargetID = 0;
+	for (auto song = medley.begin(); song != medley.end(); song++)
+	{
+		const SongDescriptor& desc = *song->desc;
+		const bool memorized = isSongMemorized(desc);
+		const bool ready = memorized ? desc.isReady() : canMemorize(desc);
+		if (!ready) {
+			DebugSpew("MQ2Medley::scheduleNextSong skipping[%s] (not ready)", desc.name.c_str());
+			continue;
+		}
+		if (!desc.evalCondition()) {
+			DebugSpew("MQ2Medley::scheduleNextSong skipping[%s] (condition not met)", desc.name.c_str());
+			continue;
+		}
+		const unsigned int targetID = songTargetID(*song);
+		if (isSongBlocked(*song, targetID)) {
+			DebugSpew("MQ2Medley::scheduleNextSong skipping[%s] (target immune, resisting or out of range)", desc.name.c_str());
+			castsSuppressed++;
+			continue;
+		}
+
+		const uint64_t expires = getSongExpires(desc);
+
+		// for a 3s casting time song, we should recast if it will expire in the next 6 seconds
+		// the constant 3 seconds is we will assume if we don't cast this song now, the next song will probably be a 3
+		// second cast time song
+		uint64_t startCastByMs = expires - desc.getCastTimeMs() - 3000;
+		if (!memorized)
+			startCastByMs -= memorizeCostMs;
+		if (DebugMode) WriteChatf("MQ2Medley::scheduleNextSong time till need to cast %s: %I64d ms", desc.name.c_str(), startCastByMs - currentTickMs);
+
+		if (startCastByMs < currentTickMs) {
+			if (memorized || pickSwapGem(currentTickMs) >= 0)
+				return withTarget(*song, targetID);
+			continue;
+		}
+		// only memorize songs that are due
+		if (!memorized)
+			continue;
+
+		if (!stalestSong || expires < stalestExpires) {
+			stalestSong = &(*song);
+			stalestExpires = expires;
+			stalestTargetID = targetID;
+		}
+	}
+
+	// nothing is due on us, refresh whatever group members in range are missing most
+	if (const SongData* groupSong = mostMissingSong(currentTickMs)) {
+		if (groupSong->desc->isReady() && groupSong->desc->evalCondition()) {
+			const unsigned int targetID = songTargetID(*groupSong);
+			if (!isSongBlocked(*groupSong, targetID)) {
+				if (DebugMode) WriteChatf("MQ2Medley::scheduleNextSong refreshing %s for group members", groupSong->desc->name.c_str());
+				return withTarget(*groupSong, targetID);
+			}
+		}
+	}
+
+	// we didn't find a song that had priority to cast, so we'll cast the song that will expirest instead
+	if (stalestSong)
+	{
+		if (DebugMode) WriteChatf("MQ2Medley::scheduleNextSong no priority song found, returning stalest song: %s", stalestSong->desc->name.c_str());
+		return withTarget(*stalestSong, stalestTargetID);
+	}
+	else {
+		if (!quiet) WriteChatf(PLUGIN_MSG "\atFAILED to schedule a song, no songs ready or conditions not met");
+		return SongData();
+	}
+}
+
+
+/**
+* Saved state
+*
+* Song expiries, the once queue and what we have learned about songs are written to
+* MQ2Medley_server_char.dat every STATE_SAVE_INTERVAL_MS, when leaving the game and on unload,
+* and read back the next time we are in game.  Times are saved as time left at the wall clock
+* time of the save, so whatever time passed while unloaded or logged out is taken off on restore.
+* Dot timers and queued songs with a target only come back in the zone they were saved in, spawn
+* IDs mean nothing anywhere else.
+*
+*   MQ2Medley <version> <wall ms> <zone>
+*   E <ms left> <song>                            song expiry
+*   M <spawn> <ms left> <song>                    dot expiry on a mob
+*   Q <priority> <target> <age ms> <ttl ms left, -1 for none> <song>
+*   L <learned duration ms> <seen on self> <song>
+*   G <ms left> <backoff ms left> <missed> <observed> <member> <song>   group member coverage
+*   C <memorize cost ms>
+*/
+constexpr int STATE_VERSION = 1;
+constexpr uint64_t STATE_SAVE_INTERVAL_MS = 30000;
+uint64_t stateSaveDue = 0;
+bool stateRestored = false;         // don't save over a file we haven't read yet
+std::future<void> pendingStateSave;
+
+int64_t wallClockMs()
+{
+	return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::system_clock::now().time_since_epoch()).count();
+}
+
+bool stateFileName(char* szFile, size_t fileSize)
+{
+	PCHARINFO pCharInfo = GetCharInfo();
+	if (!pCharInfo)
+		return false;
+	sprintf_s(szFile, fileSize, "%s\\MQ2Medley_%s_%s.dat", gPathConfig, GetServerShortName(), pCharInfo->Name);
+	return true;
+}
+
+std::string buildStateSnapshot()
+{
+	const uint64_t now = MQGetTickCount64();
+	std::string snapshot;
+	char line[MAX_STRING] = { 0 };
+
+	sprintf_s(line, "MQ2Medley %d %lld %s\n", STATE_VERSION, wallClockMs(), currentZoneShortName());
+	snapshot += line;
+	for (const auto& song : songExpires)
+	{
+		if (song.second > now) {
+			sprintf_s(line, "E %I64u %s\n", song.second - now, song.first.c_str());
+			snapshot += line;
+		}
+	}
+	for (const auto& mob : songExpiresMob)
+	{
+		for (const auto& song : mob.second)
+		{
+			if (song.second > now) {
+				sprintf_s(line, "M %u %I64u %s\n", mob.first, song.second - now, song.first.c_str());
+				snapshot += line;
+			}
+		}
+	}
+	for (const SongData& song : onceQueue)
+	{
+		const int64_t ttlLeft = song.deadlineMs ? static_cast<int64_t>(song.deadlineMs) - static_cast<int64_t>(now) : -1;
+		if (song.deadlineMs && ttlLeft <= 0)
+			continue;
+		sprintf_s(line, "Q %d %u %I64u %lld %s\n", song.priority, song.targetID, now - song.queuedMs, ttlLeft, song.desc->name.c_str());
+		snapshot += line;
+	}
+	for (const auto& song : songObservations)
+	{
+		if (song.second.learnedDurationMs || song.second.seenOnSelf) {
+			sprintf_s(line, "L %u %d %s\n", song.second.learnedDurationMs, song.second.seenOnSelf ? 1 : 0, song.first.c_str());
+			snapshot += line;
+		}
+	}
+	for (const auto& member : memberSongs)
+	{
+		for (const auto& song : member.second)
+		{
+			const MemberSong& tracked = song.second;
+			if (!tracked.missed && !tracked.observed && tracked.backoffUntilMs <= now)
+				continue;
+			sprintf_s(line, "G %I64u %I64u %d %d %s %s\n", tracked.expiresMs > now ? tracked.expiresMs - now : 0,
+				tracked.backoffUntilMs > now ? tracked.backoffUntilMs - now : 0, tracked.missed ? 1 : 0, tracked.observed ? 1 : 0,
+				member.first.c_str(), song.first.c_str());
+			snapshot += line;
+		}
+	}
+	sprintf_s(line, "C %I64u\n", memorizeCostMs);
+	snapshot += line;
+	return snapshot;
+}
+
+// the write happens on a worker thread unless wait is set
+void saveState(bool wait)
+{
+	char szFile[MAX_PATH] = { 0 };
+	if (!stateRestored || !stateFileName(szFile, MAX_PATH))
+		return;
+
+	MEDLEY_ALLOCATION_EXPECTED();
+	stateSaveDue = MQGetTickCount64() + STATE_SAVE_INTERVAL_MS;
+	// written to a temp file and moved over, a crash mid write leaves the last good save
+	pendingStateSave = std::async(std::launch::async, [file = std::string(szFile), snapshot = buildStateSnapshot()]() {
+		const std::string temp = file + ".tmp";
+		FILE* fp = nullptr;
+		if (fopen_s(&fp, temp.c_str(), "w") || !fp)
+			return;
+		fputs(snapshot.c_str(), fp);
+		fclose(fp);
+		MoveFileExA(temp.c_str(), file.c_str(), MOVEFILE_REPLACE_EXISTING);
+	});
+	if (wait)
+		pendingStateSave.wait();
+}
+
+void restoreState()
+{
+	stateRestored = true;
+	stateSaveDue = MQGetTickCount64() + STATE_SAVE_INTERVAL_MS;
+	char szFile[MAX_PATH] = { 0 };
+	FILE* fp = nullptr;
+	if (!stateFileName(szFile, MAX_PATH) || fopen_s(&fp, szFile, "r") || !fp)
+		return;
+
+	char line[MAX_STRING] = { 0 };
+	int version = 0;
+	int64_t savedWallMs = 0;
+	char savedZone[MAX_STRING] = { 0 };
+	if (!fgets(line, MAX_STRING, fp) || sscanf_s(line, "MQ2Medley %d %lld %s", &version, &savedWallMs, savedZone, MAX_STRING) < 2 || version != STATE_VERSION) {
+		fclose(fp);
+		return;
+	}
+	const uint64_t now = MQGetTickCount64();
+	const int64_t elapsedMs = std::max<int64_t>(wallClockMs() - savedWallMs, 0);
+	const bool sameZone = !_stricmp(savedZone, currentZoneShortName());
+	int restored = 0;
+
+	while (fgets(line, MAX_STRING, fp))
+	{
+		line[strcspn(line, "\r\n")] = 0;
+		int nameAt = 0;
+		uint64_t leftMs = 0;
+		switch (line[0]) {
+		case 'E':
+			if (sscanf_s(line, "E %I64u %n", &leftMs, &nameAt) >= 1 && nameAt && static_cast<int64_t>(leftMs) > elapsedMs) {
+				const std::string name = line + nameAt;
+				songExpires[name] = now + leftMs - elapsedMs;
+				restored++;
+			}
+			break;
+		case 'M': {
+			unsigned int spawnID = 0;
+			if (sameZone && sscanf_s(line, "M %u %I64u %n", &spawnID, &leftMs, &nameAt) >= 2 && nameAt
+				&& static_cast<int64_t>(leftMs) > elapsedMs && GetSpawnByID(spawnID)) {
+				songExpiresMob[spawnID][line + nameAt] = now + leftMs - elapsedMs;
+				restored++;
+			}
+			break;
+		}
+		case 'Q': {
+			int priority = 0;
+			unsigned int targetID = 0;
+			uint64_t ageMs = 0;
+			int64_t ttlLeftMs = 0;
+			if (sscanf_s(line, "Q %d %u %I64u %lld %n", &priority, &targetID, &ageMs, &ttlLeftMs, &nameAt) < 4 || !nameAt)
+				break;
+			if ((ttlLeftMs >= 0 && ttlLeftMs <= elapsedMs) || (targetID && (!sameZone || !GetSpawnByID(targetID))))
+				break;
+			std::shared_ptr<SongDescriptor> queuedSong = getSongData(line + nameAt);
+			if (!queuedSong)
+				break;
+			queuedSong->compile();
+			SongData songData(std::move(queuedSong));
+			songData.once = true;
+			songData.targetID = targetID;
+			songData.priority = priority;
+			songData.queuedMs = now - std::min<uint64_t>(ageMs + elapsedMs, now);
+			songData.deadlineMs = ttlLeftMs >= 0 ? now + ttlLeftMs - elapsedMs : 0;
+			queueOnce(songData);
+			restored++;
+			break;
+		}
+		case 'L': {
+			uint32_t learnedMs = 0;
+			int seenOnSelf = 0;
+			if (sscanf_s(line, "L %u %d %n", &learnedMs, &seenOnSelf, &nameAt) >= 2 && nameAt) {
+				SongObservation& observation = songObservations[line + nameAt];
+				observation.learnedDurationMs = learnedMs;
+				observation.seenOnSelf = seenOnSelf != 0;
+			}
+			break;
+		}
+		case 'G': {
+			uint64_t backoffMs = 0;
+			int missed = 0;
+			int observed = 0;
+			char member[MAX_STRING] = { 0 };
+			if (sscanf_s(line, "G %I64u %I64u %d %d %s %n", &leftMs, &backoffMs, &missed, &observed, member, MAX_STRING, &nameAt) < 5 || !nameAt)
+				break;
+			MemberSong& tracked = memberSongs[member][line + nameAt];
+			tracked.expiresMs = static_cast<int64_t>(leftMs) > elapsedMs ? now + leftMs - elapsedMs : 0;
+			tracked.backoffUntilMs = static_cast<int64_t>(backoffMs) > elapsedMs ? now + backoffMs - elapsedMs : 0;
+			tracked.missed = missed != 0;
+			tracked.observed = observed != 0;
+			break;
+		}
+		case 'C':
+			if (sscanf_s(line, "C %I64u", &leftMs) == 1 && leftMs)
+				memorizeCostMs = leftMs;
+			break;
+		default:
+			break;
+		}
 	}
+	fclose(fp);
 
-	bool ToString(MQVarPtr VarPtr, char* Destination) override
+	// let reconciling drop anything that wore off or was removed while we were gone, without
+	// learning a duration from it
+	for (auto& song : songExpires)
 	{
-		strcpy_s(Destination, MAX_STRING, bTwist ? "TRUE" : "FALSE");
-		return true;
+		auto observation = songObservations.find(song.first);
+		if (observation != songObservations.end() && observation->second.seenOnSelf) {
+			observation->second.landedMs = now - BUFF_LAND_MS - 1;
+			observation->second.observedSinceCast = true;
+		}
 	}
+	DebugSpew("MQ2Medley::restoreState - %d timers and queued songs restored, %lld ms since save", restored, elapsedMs);
+	if (restored && !quiet)
+		WriteChatf(PLUGIN_MSG "\atRestored %d song timers and queued songs.", restored);
+}
+
+// chat lines we act on
+enum class ChatMatch {
+	None,
+	Interrupted,
+	Stunned,
+	OutOfRange,
+	Immune,
+	Resisted
 };
 
-bool dataMedley(const char* szIndex, MQTypeVar& Dest)
+// what Line means to us, spell is set to the spell named by a resist message, or the whole line
+// for an immune message.  No side effects,
+// so /medley bench can run it over a chat corpus.
+ChatMatch matchChat(const char* Line, std::string_view& spell)
 {
-	Dest.DWord = 1;
-	Dest.Type = pMedleyType;
-	return true;
+	if ((strstr(Line, "You miss a note, bringing your ") && strstr(Line, " to a close!")) ||
+		!strcmp(Line, "You haven't recovered yet...") ||
+		(strstr(Line, "Your ") && strstr(Line, " spell is interrupted.")))
+		return ChatMatch::Interrupted;
+	if (!strcmp(Line, "You can't cast spells while stunned!"))
+		return ChatMatch::Stunned;
+	if (!strcmp(Line, "Your target is out of range, get closer!"))
+		return ChatMatch::OutOfRange;
+	if (starts_with(Line, "Your target cannot be mesmerized") || starts_with(Line, "Your target is immune to")) {
+		spell = Line;
+		return ChatMatch::Immune;
+	}
+	if (starts_with(Line, "Your target resisted the ")) {
+		// Your target resisted the Slumber of Silisia spell.
+		spell = Line + strlen("Your target resisted the ");
+		if (ends_with(spell, " spell."))
+			spell.remove_suffix(strlen(" spell."));
+		return ChatMatch::Resisted;
+	}
+	return ChatMatch::None;
 }
 
-const SongData scheduleNextSong()
-{
-	uint64_t currentTickMs = MQGetTickCount64();
 
-	if (DebugMode) WriteChatf("MQ2Medley::scheduleNextSong - currentTickMs=%I64u", currentTickMs);
-	SongData* stalestSong = nullptr;
-	for (auto song = medley.begin(); song != medley.end(); song++)
-	{
-		if (!song->isReady()) {
-			DebugSpew("MQ2Medley::scheduleNextSong skipping[%s] (not ready)", song->name.c_str());
-			continue;
-		}
-		if (!song->evalCondition()) {
-			DebugSpew("MQ2Medley::scheduleNextSong skipping[%s] (condition not met)", song->name.c_str());
-			continue;
-		}
+/**
+* /medley bench [iterations]
+*
+* Times the scheduler with 1 to 30 songs, expression evaluation, chat matching and medley loading
+* against the live game.  Each result is one JSON object per line, shown in chat and appended to
+* MQ2Medley_Bench.jsonl, so runs from different versions can be compared.  Chat matching uses
+* MQ2Medley_ChatCorpus.txt (one captured line per line) when it exists, otherwise a built in sample.
+* The game is frozen while it runs.
+*/
+const char* BenchChatCorpus[] = {
+	"You miss a note, bringing your Selo's Accelerating Chorus to a close!",
+	"You haven't recovered yet...",
+	"Your Slumber of Silisia spell is interrupted.",
+	"You can't cast spells while stunned!",
+	"Your target is out of range, get closer!",
+	"Your target cannot be mesmerized.",
+	"Your target is immune to changes in its attack speed.",
+	"Your target resisted the Slumber of Silisia spell.",
+	"You begin casting Aria of Pli Xin Liako.",
+	"A gnoll pup hits YOU for 12 points of damage.",
+	"Soandso tells the group, 'inc'",
+	"You slash a gnoll pup for 214 points of damage.",
+	"Your song of the sleepwalker fades.",
+	"You have gained experience!",
+};
 
-		if (song->once) {
-			SongData nextSong = *song;
-			medley.erase(song);
-			return nextSong;
-		}
+double benchElapsedUs(std::chrono::steady_clock::time_point start)
+{
+	return std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+}
 
-		if (!stalestSong)
-			stalestSong = &(*song);
+void writeBenchResult(FILE* file, const char* bench, int size, int operations, double totalUs)
+{
+	char line[MAX_STRING] = { 0 };
+	sprintf_s(line, "{\"plugin\":\"MQ2Medley\",\"version\":%.2f,\"bench\":\"%s\",\"size\":%d,\"operations\":%d,\"total_us\":%.1f,\"per_op_ns\":%.1f}",
+		MQ2Version, bench, size, operations, totalUs, operations ? totalUs * 1000.0 / operations : 0.0);
+	if (file)
+		fprintf(file, "%s\n", line);
+	WriteChatf(PLUGIN_MSG "\at%s", line);
+}
 
-		// for a 3s casting time song, we should recast if it will expire in the next 6 seconds
-		// the constant 3 seconds is we will assume if we don't cast this song now, the next song will probably be a 3
-		// second cast time song
-		uint64_t startCastByMs = getSongExpires(*song) - song->getCastTimeMs() - 3000;
-		if (DebugMode) WriteChatf("MQ2Medley::scheduleNextSong time till need to cast %s: %I64d ms", song->name.c_str(), startCastByMs - currentTickMs);
+void runBenchmarks(int iterations)
+{
+	if (medley.empty()) {
+		WriteChatf(PLUGIN_MSG "\atLoad a medley first, the benchmark uses its songs.");
+		return;
+	}
 
-		// for a 3s casting time song, we should recast if it will expire in the next 6 seconds
-		// the constant 3 seconds is we will assume if we don't cast this song now, the next song will probably be a 3
-		// second cast time song
-		if (startCastByMs < currentTickMs)
-			return *song;
+	char path[MAX_PATH] = { 0 };
+	sprintf_s(path, "%s\\MQ2Medley_Bench.jsonl", gPathConfig);
+	FILE* file = nullptr;
+	fopen_s(&file, path, "a");
+
+	// nothing the benchmark does should show up in chat or the stats
+	const bool savedQuiet = quiet;
+	const bool savedDebug = DebugMode;
+	const uint32_t savedSuppressed = castsSuppressed;
+	quiet = true;
+	DebugMode = false;
+
+	// scheduler, the medley is cycled to make up the song count
+	std::list<SongData> savedMedley, savedQueue;
+	savedMedley.swap(medley);
+	savedQueue.swap(onceQueue);
+	for (int size : { 1, 5, 10, 20, MAX_MEDLEY_SIZE })
+	{
+		medley.clear();
+		auto source = savedMedley.cbegin();
+		for (int i = 0; i < size; i++) {
+			medley.push_back(*source);
+			if (++source == savedMedley.cend())
+				source = savedMedley.cbegin();
+		}
+		const auto start = std::chrono::steady_clock::now();
+		for (int i = 0; i < iterations; i++)
+			scheduleNextSong();
+		writeBenchResult(file, "schedule", size, iterations, benchElapsedUs(start));
+	}
+	medley.swap(savedMedley);
+	onceQueue.swap(savedQueue);
 
-		if (getSongExpires(*song) < getSongExpires(*stalestSong))
-			stalestSong = &(*song);
+	// expressions, every condition and duration in the medley
+	{
+		int evaluations = 0;
+		const auto start = std::chrono::steady_clock::now();
+		for (int i = 0; i < iterations; i++) {
+			for (const SongData& song : medley) {
+				song.desc->evalCondition();
+				song.desc->evalDuration();
+				evaluations += 2;
+			}
+		}
+		writeBenchResult(file, "expression", static_cast<int>(medley.size()), evaluations, benchElapsedUs(start));
 	}
 
-	// we didn't find a song that had priority to cast, so we'll cast the song that will expirest instead
-	if (stalestSong)
+	// chat matching
 	{
-		if (DebugMode) WriteChatf("MQ2Medley::scheduleNextSong no priority song found, returning stalest song: %s", stalestSong->name.c_str());
-		return *stalestSong;
+		std::vector<std::string> corpus;
+		char corpusPath[MAX_PATH] = { 0 };
+		sprintf_s(corpusPath, "%s\\MQ2Medley_ChatCorpus.txt", gPathConfig);
+		FILE* corpusFile = nullptr;
+		if (!fopen_s(&corpusFile, corpusPath, "r") && corpusFile) {
+			char line[MAX_STRING] = { 0 };
+			while (fgets(line, MAX_STRING, corpusFile)) {
+				line[strcspn(line, "\r\n")] = 0;
+				corpus.emplace_back(line);
+			}
+			fclose(corpusFile);
+		}
+		if (corpus.empty())
+			corpus.assign(std::begin(BenchChatCorpus), std::end(BenchChatCorpus));
+
+		int matched = 0;
+		std::string_view spell;
+		const auto start = std::chrono::steady_clock::now();
+		for (int i = 0; i < iterations; i++) {
+			for (const std::string& line : corpus)
+				matched += matchChat(line.c_str(), spell) != ChatMatch::None;
+		}
+		writeBenchResult(file, "chat", static_cast<int>(corpus.size()), iterations * static_cast<int>(corpus.size()), benchElapsedUs(start));
+		DebugSpew("MQ2Medley::runBenchmarks - %d chat matches", matched);
 	}
-	else {
-		if (!quiet) WriteChatf(PLUGIN_MSG "\atFAILED to schedule a song, no songs ready or conditions not met");
-		return nullSong;
+
+	// medley loading, file reads are slow so fewer of them
+	if (!medleyName.empty()) {
+		const int loads = std::max(iterations / 100, 10);
+		MedleyDefinition def;
+		auto start = std::chrono::steady_clock::now();
+		for (int i = 0; i < loads; i++)
+			def = readMedleyDefinition(INIFileName, medleyName, false);
+		writeBenchResult(file, "ini_read", static_cast<int>(def.entries.size()), loads, benchElapsedUs(start));
+
+		start = std::chrono::steady_clock::now();
+		for (int i = 0; i < loads; i++) {
+			SongResolver resolver(def.name);
+			for (const MedleyEntryDef& entry : def.entries)
+				resolver.resolve(entry.name.c_str());
+		}
+		writeBenchResult(file, "resolve", static_cast<int>(def.entries.size()), loads, benchElapsedUs(start));
+	}
+
+	quiet = savedQuiet;
+	DebugMode = savedDebug;
+	castsSuppressed = savedSuppressed;
+	if (file) {
+		fclose(file);
+		WriteChatf(PLUGIN_MSG "\atBenchmark results appended to %s", path);
 	}
 }
 
@@ -896,33 +3776,168 @@ PLUGIN_API void ShutdownPlugin()
 	RemoveCommand("/medley");
 	RemoveMQ2Data("Medley");
 	delete pMedleyType;
+	saveState(true);
+	closeBlackboard();
+	pendingMedley = {};
 }
 
 
-PLUGIN_API void OnPulse()
+bool SongIFMet()
 {
+	if (SongIF[0] == 0)
+		return true;
+
 	char szTemp[MAX_STRING] = { 0 };
+	Evaluate(szTemp, "${If[%s,1,0]}", SongIF);
+	if (DebugMode) WriteChatf(PLUGIN_MSG "\atOnPulse SongIF[%s]=>[%s]=%d", SongIF, szTemp, GetIntFromString(szTemp, 0));
+	return GetIntFromString(szTemp, 0) != 0;
+}
 
-	//DebugSpew("MQ2Medley::pulse -OnPulse()");
-	if (!MQ2MedleyEnabled || !CheckCharState())
+void restoreTarget()
+{
+	if (bTargetSwapped) {
+		DebugSpew("MQ2Medley::pulse - restoring target to SpawnID %d", TargetSave ? TargetSave->SpawnID : 0);
+		pTarget = TargetSave;
+		TargetSave = nullptr;
+		bTargetSwapped = false;
+
+		targetSwapLastMs = MQGetTickCount64() - targetSwapMs;
+		targetSwapCount++;
+		targetSwapTotalMs += targetSwapLastMs;
+		targetSwapMaxMs = std::max(targetSwapMaxMs, targetSwapLastMs);
+	}
+}
+
+// start casting currentSong, and move on to the state that follows
+void startCurrentSong()
+{
+	int32_t castTimeMs = doCast(currentSong);
+
+	if (DebugMode) WriteChatf("MQ2Medley::OnPulse - casting time for %s - %d ms", currentSong.desc->name.c_str(), castTimeMs);
+	if (castTimeMs != -1)  // cast failed
+	{
+		// cast started successfully - update CastDue and PrevSong is now the song we're casting.
+		CastDue = MQGetTickCount64() + castTimeMs + castPadTimeMs;
+		castEvent = CastEvent::None;
+		watchCast(castTimeMs);
+		recordCast(currentSong, CastDue - castPadTimeMs);
+		if (bCoordinate && !currentSong.once && !currentSong.desc->isDot)
+			publishBlackboard(currentSong.desc->name.c_str(), CastDue);
+		fireMedleyEvent(MEDLEY_EVENT_CAST_START, currentSong);
+		startPreEvaluation();
+		setMedleyState(bTargetSwapped ? MedleyState::TargetRestore : MedleyState::Casting);
+	}
+	else {
+		DebugSpew("MQ2Medley::OnPulse - cast failed for %s", currentSong.desc->name.c_str());
+		fireMedleyEvent(MEDLEY_EVENT_INTERRUPT, currentSong);
+		currentSong.clear();
+		setMedleyState(MedleyState::Scheduling);
 		return;
+	}
+
+	DebugSpew("MQ2Medley::OnPulse - exit handling new song: %s", currentSong.desc->name.c_str());
+}
+
+// successful cast, song is now up
+void finishCurrentSong()
+{
+	if (!currentSong.isNull() && !currentSong.once) {
+		const uint64_t previousMs = getSongExpires(*currentSong.desc);
+		const uint64_t expiresMs = MQGetTickCount64() + (uint32_t)(currentSong.desc->evalDuration() * 1000);
+		setSongExpires(*currentSong.desc, expiresMs);
+		songLanded(*currentSong.desc);
+		songReachedGroup(*currentSong.desc, previousMs, expiresMs);
+	}
+	if (!currentSong.isNull())
+		fireMedleyEvent(MEDLEY_EVENT_CAST_COMPLETE, currentSong);
+	currentSong.clear();
+}
 
-	// if (medley.empty() && altQueue.empty()) return;
-	if (medley.empty())
+// fire the next burst action as soon as it is ready, no pad
+void pulseBursting()
+{
+	const uint64_t now = MQGetTickCount64();
+	if (!burstAction.isNull()) {
+		// an action with a cast time is still going
+		if (now < burstNextMs)
+			return;
+		fireMedleyEvent(MEDLEY_EVENT_CAST_COMPLETE, burstAction);
+		burstAction.clear();
+	}
+	if (burstQueue.empty()) {
+		finishBurst();
+		setMedleyState(bTwist ? MedleyState::Scheduling : MedleyState::Idle);
+		return;
+	}
+	// a burst fires with the medley stopped too, so not CheckCharState
+	if (!canSing() || (pCastingWnd && pCastingWnd->IsVisible()))
 		return;
 
-	if (TargetSave) {
-		//DebugSpew("MQ2Medley::pulse -OnPulse() in if(TargetSave)");
-		//// wait for next song to start casting before switching target back
-		//if (getCurrentCastingSpell() && currentSong.name.compare(szCurrentCastingSpell) == 0)
-		//{
-		DebugSpew("MQ2Medley::pulse - restoring target to SpawnID %d", TargetSave->SpawnID);
-		pTarget = TargetSave;
-		TargetSave = nullptr;
-		//	return;
-		//}
-		//DebugSpew("MQ2Medley::pulse - state not ready to restore target");
-		//return;
+	SongData& action = burstQueue.front();
+	if (!action.desc->isReady()) {
+		const int64_t readyInMs = action.desc->readyInMs();
+		if (!burstWaitStartMs)
+			burstWaitStartMs = now;
+		if (now > burstWaitStartMs + BURST_READY_WAIT_MS || (readyInMs > 0 && now + readyInMs > burstWaitStartMs + BURST_READY_WAIT_MS)) {
+			if (!quiet) WriteChatf(PLUGIN_MSG "\ayBurst: %s is not ready, skipping", action.desc->name.c_str());
+			burstSkipped++;
+			burstWaitStartMs = 0;
+			burstQueue.pop_front();
+		}
+		return;
+	}
+	burstWaitStartMs = 0;
+
+	const int32_t castTimeMs = doCast(action);
+	if (castTimeMs < 0) {
+		fireMedleyEvent(MEDLEY_EVENT_INTERRUPT, action);
+		burstSkipped++;
+		burstQueue.pop_front();
+		return;
+	}
+	if (!burstStartMs)
+		burstStartMs = now;
+	burstFired++;
+	burstLastFiredMs = now;
+	recordCast(action, now + castTimeMs);
+	// instants are done once sent, the next one goes out on the next pulse
+	burstNextMs = now + (castTimeMs > static_cast<int32_t>(INSTANT_CAST_MS) ? castTimeMs : 0);
+	fireMedleyEvent(MEDLEY_EVENT_CAST_START, action);
+	burstAction = std::move(action);
+	burstQueue.pop_front();
+}
+
+void pulseIdle()
+{
+	if (!burstQueue.empty())
+		setMedleyState(MedleyState::Bursting);
+	else if (bTwist && !(medley.empty() && onceQueue.empty()))
+		setMedleyState(MedleyState::Scheduling);
+}
+
+void pulsePaused()
+{
+	if (!bTwist || (medley.empty() && onceQueue.empty()))
+		setMedleyState(MedleyState::Idle);
+	else if (CheckCharState() && (!burstQueue.empty() || SongIFMet()))
+		setMedleyState(MedleyState::Scheduling);
+}
+
+void pulseScheduling()
+{
+	if (!burstQueue.empty()) {
+		// the burst goes before anything else, SongIF doesn't hold it up
+		setMedleyState(MedleyState::Bursting);
+		pulseBursting();
+		return;
+	}
+	if (!bTwist || (medley.empty() && onceQueue.empty())) {
+		setMedleyState(MedleyState::Idle);
+		return;
+	}
+	if (!CheckCharState()) {
+		setMedleyState(MedleyState::Paused);
+		return;
 	}
 
 	if (pCastingWnd && pCastingWnd->IsVisible()) {
@@ -931,64 +3946,238 @@ PLUGIN_API void OnPulse()
 		return;
 	}
 
-	if (SongIF[0] != 0)
-	{
-		Evaluate(szTemp, "${If[%s,1,0]}", SongIF);
-		if (DebugMode) WriteChatf(PLUGIN_MSG "\atOnPulse SongIF[%s]=>[%s]=%d", SongIF, szTemp, GetIntFromString(szTemp, 0));
-		if (GetIntFromString(szTemp, 0) == 0)
-			return;
+	reconcileNextSong();
+
+	if (!SongIFMet()) {
+		setMedleyState(MedleyState::Paused);
+		return;
 	}
 
-	// get the next song
-	//DebugSpew("MQ2Medley::Pulse (twist) before cast, CurrSong=%d, PrevSong = %d, CastDue -GetTime() = %d", CurrSong, PrevSong, (CastDue-GetTime()));
-	if (MQGetTickCount64() > CastDue) {
-		DebugSpew("MQ2Medley::Pulse - time for next cast");
-		if (bWasInterrupted && currentSong.type != SongData::NOT_FOUND && currentSong.isReady())
-		{
-			bWasInterrupted = false;
-			if (!quiet) WriteChatf("MQ2Medley::OnPulse Spell inturrupted - recast it");
-			// current song is unchanged
+	DebugSpew("MQ2Medley::Pulse - time for next cast");
+	currentSong = takeNextSong();
+	if (currentSong.isNull())
+		return;
+	if (!quiet) WriteChatf(PLUGIN_MSG "\atScheduled: %s", currentSong.desc->name.c_str());
+
+	if (!isSongMemorized(*currentSong.desc)) {
+		// sing it once it is memorized and the gem is ready, queued songs wait in the queue
+		if (startMemorize())
+			setMedleyState(MedleyState::Memorizing);
+		if (currentSong.once) {
+			MEDLEY_ALLOCATION_EXPECTED();
+			queueOnce(currentSong);
 		}
-		else {
-			if (bWasInterrupted)
-			{
-				if (!quiet) WriteChatf("MQ2Medley::OnPulse Spell inturrupted - spell not ready skip it");
-				bWasInterrupted = false;
-			}
-			if (currentSong.type != SongData::NOT_FOUND)
-			{
-				// successful cast
-				if (!currentSong.once)
-					setSongExpires(currentSong, MQGetTickCount64() + (uint32_t)(currentSong.evalDuration() * 1000));
-			}
-			if (!medley.empty())
-			{
-				currentSong = scheduleNextSong();
-				if (currentSong.type == 4) return;
-				if (!quiet) WriteChatf(PLUGIN_MSG "\atScheduled: %s", currentSong.name.c_str());
-				if (currentSong.targetExp.length() > 0)
-					currentSong.targetID = currentSong.evalTarget();
-			}
+		currentSong.clear();
+		return;
+	}
+
+	startCurrentSong();
+}
+
+void pulseMemorizing()
+{
+	const uint64_t now = MQGetTickCount64();
+	PcProfile* pProfile = GetPcProfile();
+	bool done = false;
+	if (pProfile && memorizeSong && pProfile->MemorizedSpells[memorizeGem] == memorizeSong->spellID) {
+		const uint64_t costMs = now - memorizeStartMs + GetSpellGemTimer(memorizeGem);
+		memorizeCostMs = (memorizeCostMs * 3 + costMs) / 4;
+		memorizeCount++;
+		DebugSpew("MQ2Medley::pulseMemorizing - %s memorized, cost %I64u ms", memorizeSong->name.c_str(), costMs);
+		done = true;
+	}
+	else if (!bTwist || now > memorizeStartMs + MEMORIZE_TIMEOUT_MS) {
+		if (bTwist) {
+			WriteChatf(PLUGIN_MSG "\arCould not memorize %s in gem %d.", memorizeSong ? memorizeSong->name.c_str() : "", memorizeGem + 1);
+			memorizeFailures++;
 		}
+		done = true;
+	}
+	if (!done)
+		return;
 
-		int32_t castTimeMs = doCast(currentSong);
+	memorizeSong.reset();
+	memorizeGem = -1;
+	if (GetCharInfo() && GetCharInfo()->standstate == STANDSTATE_SIT)
+		MQ2MedleyDoCommand("/stand");
+	setMedleyState(bTwist ? MedleyState::Scheduling : MedleyState::Idle);
+}
 
-		if (DebugMode) WriteChatf("MQ2Medley::OnPulse - casting time for %s - %d ms", currentSong.name.c_str(), castTimeMs);
-		if (castTimeMs != -1)  // cast failed
-		{
-			// cast started successfully - update CastDue and PrevSong is now the song we're casting.
-			CastDue = MQGetTickCount64() + castTimeMs + castPadTimeMs;
+// hold the borrowed target until the game shows the cast started, so the song lands on it,
+// then give our target back right away
+void pulseTargetRestore()
+{
+	if (castEvent != CastEvent::None) {
+		restoreTarget();
+		fireMedleyEvent(MEDLEY_EVENT_INTERRUPT, currentSong);
+		setMedleyState(MedleyState::Recovering);
+		return;
+	}
+
+	// instant casts can start and finish between pulses, don't hold the target longer than the cast
+	const uint64_t timeoutMs = std::min<uint64_t>(TARGET_RESTORE_TIMEOUT_MS, std::max<uint64_t>(currentSong.isNull() ? 0 : currentSong.desc->getCastTimeMs(), 1));
+	if (sampleCast() == NativeCast::Running) {
+		restoreTarget();
+	}
+	else if (MQGetTickCount64() > targetSwapMs + timeoutMs) {
+		DebugSpew("MQ2Medley::pulseTargetRestore - cast start not seen after %I64u ms, restoring target", timeoutMs);
+		targetSwapTimeouts++;
+		restoreTarget();
+	}
+	else {
+		return;
+	}
+	setMedleyState(MedleyState::Casting);
+}
+
+void pulseCasting()
+{
+	if (castEvent != CastEvent::None) {
+		fireMedleyEvent(MEDLEY_EVENT_INTERRUPT, currentSong);
+		setMedleyState(MedleyState::Recovering);
+		return;
+	}
+	if (!bTwist) {
+		currentSong.clear();
+		setMedleyState(MedleyState::Idle);
+		return;
+	}
+	switch (sampleCast()) {
+	case NativeCast::Interrupted:
+		// same frame as the casting data cleared, chat may never say anything
+		castEvent = CastEvent::Interrupted;
+		fireMedleyEvent(MEDLEY_EVENT_INTERRUPT, currentSong);
+		setMedleyState(MedleyState::Recovering);
+		return;
+	case NativeCast::Completed:
+		// Delay now counts from when the song actually finished
+		CastDue = std::min(CastDue, castWatch.completedMs + castPadTimeMs);
+		break;
+	default:
+		break;
+	}
+	const uint64_t now = MQGetTickCount64();
+	if (now > CastDue || (castWatch.completedMs && now >= CastDue)) {
+		finishCurrentSong();
+		setMedleyState(MedleyState::Scheduling);
+		// the next song was worked out during this cast, send it on this frame
+		pulseScheduling();
+		return;
+	}
+	preEvaluateNextSong();
+}
+
+void pulseRecovering()
+{
+	if (!bTwist || (medley.empty() && onceQueue.empty())) {
+		castEvent = CastEvent::None;
+		currentSong.clear();
+		setMedleyState(MedleyState::Idle);
+		return;
+	}
+	// stunned, sitting, ...  recover on the first frame we can sing again
+	if (!CheckCharState())
+		return;
+
+	castEvent = CastEvent::None;
+	if (!currentSong.isNull() && currentSong.desc->isReady() && !isSongBlocked(currentSong, songTargetID(currentSong)))
+	{
+		if (!quiet) WriteChatf("MQ2Medley::OnPulse Spell inturrupted - recast it");
+		startCurrentSong();
+	}
+	else {
+		if (!quiet) WriteChatf("MQ2Medley::OnPulse Spell inturrupted - spell not ready skip it");
+		currentSong.clear();
+		setMedleyState(MedleyState::Scheduling);
+	}
+}
+
+#ifdef MEDLEY_ALLOC_COUNT
+// counts allocations for the lifetime of one OnPulse
+struct PulseAllocationCheck
+{
+	PulseAllocationCheck()
+	{
+		pulseAllocations = 0;
+		pulseAllocationExpected = false;
+		countAllocations = true;
+	}
+
+	~PulseAllocationCheck()
+	{
+		countAllocations = false;
+		if (pulseAllocationExpected) {
+			allocPulsesExempt++;
+			return;
 		}
-		else {
-			DebugSpew("MQ2Medley::OnPulse - cast failed for %s", currentSong.name.c_str());
-			currentSong = nullSong;
+		allocPulsesChecked++;
+		if (pulseAllocations) {
+			// only the first few, a regression would flood chat
+			if (allocPulsesFailed++ < 10)
+				WriteChatf(PLUGIN_MSG "\arFAIL: pulse in state %s made %u allocations", MedleyStateNames[static_cast<int>(medleyState)], pulseAllocations);
+		}
+	}
+};
+#endif
+
+PLUGIN_API void OnPulse()
+{
+	//DebugSpew("MQ2Medley::pulse -OnPulse()");
+	if (!MQ2MedleyEnabled)
+		return;
+
+#ifdef MEDLEY_ALLOC_COUNT
+	PulseAllocationCheck allocationCheck;
+#endif
+	applyPendingMedley();
+	observeMemberBuffs();
+	if (stateRestored && MQGetTickCount64() > stateSaveDue)
+		saveState(false);
+
+	// keep our blackboard slot alive even while paused, so other bards don't take our songs
+	if (bCoordinate && MQGetTickCount64() > blackboardHeartbeat + BLACKBOARD_HEARTBEAT_MS) {
+		if (blackboardSlot < 0) {
+			// if the blackboard is busy, try again on the next heartbeat
+			closeBlackboard();
+			blackboardHeartbeat = MQGetTickCount64();
+			if (openBlackboard())
+				publishBlackboard(nullptr, 0);
 		}
+		else
+			publishBlackboard(nullptr, 0);
+	}
 
-		DebugSpew("MQ2Medley::OnPulse - exit handling new song: %s", currentSong.name.c_str());
+	switch (medleyState) {
+	case MedleyState::Idle:
+		pulseIdle();
+		break;
+	case MedleyState::Paused:
+		pulsePaused();
+		break;
+	case MedleyState::Memorizing:
+		pulseMemorizing();
+		break;
+	case MedleyState::Bursting:
+		pulseBursting();
+		break;
+	case MedleyState::Scheduling:
+		pulseScheduling();
+		break;
+	case MedleyState::TargetRestore:
+		pulseTargetRestore();
+		break;
+	case MedleyState::Casting:
+		pulseCasting();
+		break;
+	case MedleyState::Recovering:
+		pulseRecovering();
+		break;
+	default:
+		setMedleyState(MedleyState::Idle);
+		break;
 	}
 }
 
-//#Event Immune "Your target cannot be mesmerized#*#"
 
 PLUGIN_API bool OnIncomingChat(const char* Line, DWORD Color)
 {
@@ -998,24 +4187,49 @@ PLUGIN_API bool OnIncomingChat(const char* Line, DWORD Color)
 
 	// if (!strcmp(Line, "You haven't recovered yet...")) WriteChatf("MQ2Medley::Have not recovered");
 
-	if ((strstr(Line, "You miss a note, bringing your ") && strstr(Line, " to a close!")) ||
-		!strcmp(Line, "You haven't recovered yet...") ||
-		(strstr(Line, "Your ") && strstr(Line, " spell is interrupted."))) {
+	std::string_view spell;
+	switch (matchChat(Line, spell)) {
+	case ChatMatch::Interrupted:
+		if (chatConfirmsInterrupt())
+			break;
 		DebugSpew("MQ2Medley::OnIncomingChat - Song Interrupt Event: %s", Line);
-		bWasInterrupted = true;
-		CastDue = 0;
-	} else if (!strcmp(Line, "You can't cast spells while stunned!")) {
+		castEvent = CastEvent::Interrupted;
+		break;
+	case ChatMatch::Stunned:
+		if (chatConfirmsInterrupt())
+			break;
 		DebugSpew("MQ2Medley::OnIncomingChat - Song Interrupt Event (stun)");
-		bWasInterrupted = true;
-		// Wait one second before trying again, to avoid spamming the trigger text w/ cast attempts
-		CastDue = MQGetTickCount64() + 10;
+		// Recovering waits for the stun to wear off before trying again
+		castEvent = CastEvent::Stunned;
+		break;
+	case ChatMatch::OutOfRange:
+		// the cast never started, don't wait for CastDue
+		if ((medleyState == MedleyState::Casting || medleyState == MedleyState::TargetRestore) && castHistory[0].desc && castHistory[0].desc == currentSong.desc) {
+			DebugSpew("MQ2Medley::OnIncomingChat - %s out of range", currentSong.desc->name.c_str());
+			songOutOfRange(castHistory[0]);
+			castEvent = CastEvent::Interrupted;
+		}
+		break;
+	case ChatMatch::Immune:
+		if (const CastRecord* cast = immuneCast(immuneSpa(spell)))
+			songImmune(*cast);
+		break;
+	case ChatMatch::Resisted:
+		if (const CastRecord* cast = landedCast(spell))
+			songResisted(*cast);
+		break;
+	default:
+		break;
 	}
 	return false;
 }
 
 PLUGIN_API void OnRemoveSpawn(SPAWNINFO* pSpawn)
 {
+	if (pSpawn == TargetSave)
+		TargetSave = nullptr;
 	songExpiresMob.erase(pSpawn->SpawnID);
+	forgetSpawnOutcomes(pSpawn->SpawnID);
 }
 
 
@@ -1023,6 +4237,8 @@ PLUGIN_API void OnRemoveSpawn(SPAWNINFO* pSpawn)
 PLUGIN_API void OnZoned()
 {
 	songExpiresMob.clear();
+	resetQueueResolver();
+	loadImmunities();
 }
 
 PLUGIN_API void SetGameState(int GameState)
@@ -1034,40 +4250,154 @@ PLUGIN_API void SetGameState(int GameState)
 		if (!Initialized && pCharInfo) {
 			Initialized = true;
 			Load_MQ2Medley_INI(pCharInfo);
+			loadImmunities();
+			restoreState();
 		}
 	}
 	else {
-		if (GameState == GAMESTATE_CHARSELECT)
+		if (Initialized)
+			saveState(true);
+		if (GameState == GAMESTATE_CHARSELECT) {
 			Initialized = false;
+			resetQueueResolver();
+			stateRestored = false;
+		}
 		MQ2MedleyEnabled = false;
 	}
 }
 
 
 /**
-* SongData Impl
+* Exported API, see MQ2Medley.h
+*/
+PLUGIN_API int MedleyAPI_Version()
+{
+	return MEDLEY_API_VERSION;
+}
+
+PLUGIN_API bool MedleyAPI_Enqueue(const char* name, uint32_t targetID, int priority, uint32_t ttlMs, bool interrupt)
+{
+	if (!name || !name[0] || !MQ2MedleyEnabled)
+		return false;
+	return enqueueSong(name, targetID, priority, ttlMs, interrupt);
+}
+
+PLUGIN_API bool MedleyAPI_GetStatus(MedleyStatus* status)
+{
+	if (!status || status->size != sizeof(MedleyStatus))
+		return false;
+	status->active = bTwist ? 1 : 0;
+	strcpy_s(status->state, MedleyStateNames[static_cast<int>(medleyState)]);
+	strncpy_s(status->medley, medleyName.c_str(), _TRUNCATE);
+	fillSongInfo(currentSong, status->current);
+	const SongData* next = peekNextSong();
+	fillSongInfo(next ? *next : SongData(), status->next);
+	status->ttqeMs = getTimeTillQueueEmptyMs();
+	status->queueLength = static_cast<int>(onceQueue.size());
+	return true;
+}
+
+// fills songs with the medley songs and returns how many, or how many there are if songs is null
+PLUGIN_API int MedleyAPI_GetExpiries(MedleySongInfo* songs, int maxSongs)
+{
+	if (!songs)
+		return static_cast<int>(medley.size());
+	int count = 0;
+	for (const SongData& song : medley) {
+		if (count >= maxSongs)
+			break;
+		fillSongInfo(song, songs[count++]);
+	}
+	return count;
+}
+
+// ms until the medley song named name wears off, 0 if it is down, -1 if it is not in the medley
+PLUGIN_API int64_t MedleyAPI_GetSongExpiresMs(const char* name)
+{
+	if (!name)
+		return -1;
+	for (const SongData& song : medley) {
+		if (!_stricmp(song.desc->name.c_str(), name)) {
+			const uint64_t now = MQGetTickCount64();
+			const uint64_t expires = getSongExpires(*song.desc);
+			return expires > now ? static_cast<int64_t>(expires - now) : 0;
+		}
+	}
+	return -1;
+}
+
+PLUGIN_API int64_t MedleyAPI_GetTTQEMs()
+{
+	return getTimeTillQueueEmptyMs();
+}
+
+// returns a subscription id for MedleyAPI_Unsubscribe, 0 on failure
+PLUGIN_API int MedleyAPI_Subscribe(fMedleyCallback callback, void* context)
+{
+	if (!callback)
+		return 0;
+	medleySubscribers.push_back({ nextSubscriberId, callback, context });
+	return nextSubscriberId++;
+}
+
+PLUGIN_API void MedleyAPI_Unsubscribe(int subscription)
+{
+	if (firingMedleyEvent) {
+		for (MedleySubscriber& subscriber : medleySubscribers) {
+			if (subscriber.id == subscription)
+				subscriber.callback = nullptr;
+		}
+		return;
+	}
+	medleySubscribers.erase(std::remove_if(medleySubscribers.begin(), medleySubscribers.end(),
+		[subscription](const MedleySubscriber& subscriber) { return subscriber.id == subscription; }), medleySubscribers.end());
+}
+
+
+/**
+* SongDescriptor Impl
 */
-SongData::SongData(std::string spellName, SpellType spellType, uint32_t spellCastTime) {
+SongDescriptor::SongDescriptor(std::string spellName, SpellType spellType, uint32_t spellCastTime) {
 	name = spellName;
 	type = spellType;
 	castTimeMs = spellCastTime;
 	durationExp = "180";    // 3 min default
-	targetID = 0;
 	conditionalExp = "1";   // default always sing
 	targetExp = "";         // expression for targetID
-	once = false;
+	buffName = spellName;
+	hasDurationExp = false;
+	spellID = 0;
+	aaID = 0;
 	isDot = spellName.find("Chant of Flame") != std::string::npos ||
 		spellName.find("Chant of Frost") != std::string::npos ||
 		spellName.find("Chant of Disease") != std::string::npos ||
 		spellName.find("Chant of Poison") != std::string::npos;
 
-	if (DebugMode) WriteChatf("MQ2Medley::SongDate(% s), isDot = % d", spellName.c_str(), isDot);
+	if (DebugMode) WriteChatf("MQ2Medley::SongDescriptor(% s), isDot = % d", spellName.c_str(), isDot);
+	compile();
+}
+
+void SongDescriptor::compile() {
+	durationCalc = "${Math.Calc[" + durationExp + "]}";
+	conditionCalc = "${Math.Calc[" + conditionalExp + "]}";
+	targetCalc = targetExp.empty() ? "" : "${Math.Calc[" + targetExp + "]}";
+	switch (type) {
+	case SongDescriptor::ITEM:
+		readyCalc = "${FindItem[=" + name + "].Timer}";
+		break;
+	case SongDescriptor::AA:
+		readyCalc = "${Me.AltAbilityReady[" + name + "]}";
+		break;
+	default:
+		readyCalc.clear();
+		break;
+	}
 }
 
-bool SongData::isReady() {
+bool SongDescriptor::isReady() const {
 	char zOutput[MAX_STRING] = { 0 };
 	switch (type) {
-	case SongData::SONG:
+	case SongDescriptor::SONG:
 		for (int i = 0; i < NUM_SPELL_GEMS; i++)
 		{
 			PSPELL pSpell = GetSpellByID(GetPcProfile()->MemorizedSpells[i]);
@@ -1075,65 +4405,88 @@ bool SongData::isReady() {
 				return GetSpellGemTimer(i) == 0;
 		}
 		return false;
-	case SongData::ITEM:
-		sprintf_s(zOutput, "${FindItem[=%s].Timer}", name.c_str());
+	case SongDescriptor::ITEM:
+		strncpy_s(zOutput, readyCalc.c_str(), _TRUNCATE);
 		ParseMacroData(zOutput,MAX_STRING);
-		DebugSpew("MQ2Medley::SongData::IsReady() ${FindItem[=%s].Timer} returned=%s", name.c_str(), zOutput);
+		DebugSpew("MQ2Medley::SongDescriptor::IsReady() %s returned=%s", readyCalc.c_str(), zOutput);
 
 		if (!_stricmp(zOutput, "null"))
 			return false;
 		return GetIntFromString(zOutput, 0) == 0;
-	case SongData::AA:
-		sprintf_s(zOutput, "${Me.AltAbilityReady[%s]}", name.c_str());
+	case SongDescriptor::AA:
+		strncpy_s(zOutput, readyCalc.c_str(), _TRUNCATE);
 		ParseMacroData(zOutput,MAX_STRING);
-		DebugSpew("MQ2Medley::SongData::IsReady() ${Me.AltAbilityReady[%s]} returned=%s", name.c_str(), zOutput);
+		DebugSpew("MQ2Medley::SongDescriptor::IsReady() %s returned=%s", readyCalc.c_str(), zOutput);
 		return _stricmp(zOutput, "TRUE") == 0;
 	default:
-		WriteChatf("MQ2Medley::SongData::isReady - unsupported type %d for \"%s\", SKIPPING", type, name.c_str());
+		WriteChatf("MQ2Medley::SongDescriptor::isReady - unsupported type %d for \"%s\", SKIPPING", type, name.c_str());
 		return false; // todo
 	}
 }
 
-uint32_t SongData::getCastTimeMs() const {
+int64_t SongDescriptor::readyInMs() const {
+	if (type == SongDescriptor::SONG) {
+		for (int i = 0; i < NUM_SPELL_GEMS; i++)
+		{
+			PSPELL pSpell = GetSpellByID(GetPcProfile()->MemorizedSpells[i]);
+			if (pSpell && starts_with(pSpell->Name, name))
+				return static_cast<int64_t>(GetSpellGemTimer(i));
+		}
+		return -1;
+	}
+	// item and AA timers aren't held up by the song being sung
+	return isReady() ? 0 : -1;
+}
+
+uint32_t SongDescriptor::getCastTimeMs() const {
 	switch (type) {
-	case SongData::SONG:
-		return GemCastTime(SongData::name);
-	case SongData::ITEM:
+	case SongDescriptor::SONG: {
+		// not memorized, use what it was when resolved
+		const int gemCastTime = GemCastTime(name);
+		return gemCastTime >= 0 ? gemCastTime : castTimeMs;
+	}
+	case SongDescriptor::ITEM:
 		return castTimeMs;
-	case SongData::AA:
+	case SongDescriptor::AA:
 		return castTimeMs;
 	default:
-		WriteChatf("MQ2Medley::SongData::getCastTimeMs - unsupported type %d for \"%s\", SKIPPING", type, name.c_str());
+		WriteChatf("MQ2Medley::SongDescriptor::getCastTimeMs - unsupported type %d for \"%s\", SKIPPING", type, name.c_str());
 		return -1;
 	}
 }
 
-double SongData::evalDuration() {
+double SongDescriptor::evalDuration() const {
+	if (!hasDurationExp) {
+		// no duration in the ini, use what we have observed the song to last
+		auto observation = songObservations.find(name);
+		if (observation != songObservations.end() && observation->second.learnedDurationMs)
+			return observation->second.learnedDurationMs / 1000.0;
+	}
+
 	char zOutput[MAX_STRING] = { 0 };
-	sprintf_s(zOutput, "${Math.Calc[%s]}", durationExp.c_str());
+	strncpy_s(zOutput, durationCalc.c_str(), _TRUNCATE);
 	ParseMacroData(zOutput,MAX_STRING);
-	if (DebugMode) WriteChatf("MQ2Medley::SongData::evalDuration() [%s] returned=%s", conditionalExp.c_str(), zOutput);
+	if (DebugMode) WriteChatf("MQ2Medley::SongDescriptor::evalDuration() [%s] returned=%s", durationExp.c_str(), zOutput);
 
 	return GetDoubleFromString(zOutput, 0.0);
 }
 
-bool SongData::evalCondition() {
+bool SongDescriptor::evalCondition() const {
 	char zOutput[MAX_STRING] = { 0 };
-	sprintf_s(zOutput, "${Math.Calc[%s]}", conditionalExp.c_str());
+	strncpy_s(zOutput, conditionCalc.c_str(), _TRUNCATE);
 	ParseMacroData(zOutput,MAX_STRING);
-	//	if (DebugMode) WriteChatf("MQ2Medley::SongData::evalCondition() [%s] returned=%s", conditionalExp.c_str(), zOutput);
-	if (DebugMode) WriteChatf("MQ2Medley::SongData::evalCondition(%s) [%s] returned=%s", name.c_str(), conditionalExp.c_str(), zOutput);
+	if (DebugMode) WriteChatf("MQ2Medley::SongDescriptor::evalCondition(%s) [%s] returned=%s", name.c_str(), conditionalExp.c_str(), zOutput);
 
 	double result = GetDoubleFromString(zOutput, 0.0);
 	return result != 0.0;
 }
 
 // FIXME: Does this need to be DWORD?
-DWORD SongData::evalTarget() {
+DWORD SongDescriptor::evalTarget() const {
 	char zOutput[MAX_STRING] = { 0 };
-	sprintf_s(zOutput, "${Math.Calc[%s]}", targetExp.c_str());
+	strncpy_s(zOutput, targetCalc.c_str(), _TRUNCATE);
 	ParseMacroData(zOutput,MAX_STRING);
-	if (DebugMode) WriteChatf("MQ2Medley::SongData::evalTarget(%s) [%s] returned=%s", name.c_str(), targetExp.c_str(), zOutput);
+	if (DebugMode) WriteChatf("MQ2Medley::SongDescriptor::evalTarget(%s) [%s] returned=%s", name.c_str(), targetExp.c_str(), zOutput);
 
 	const DWORD result = GetIntFromString(zOutput, 0);
 	return result;
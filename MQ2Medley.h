@@ -0,0 +1,71 @@
+// MQ2Medley.h - Exported API for other plugins
+//
+// Lets other plugins queue songs and read scheduler state without going through /medley or
+// ${Medley.*} parsing.  Look the functions up after MQ2Medley is loaded:
+//
+//   HMODULE hMedley = GetModuleHandle("MQ2Medley.dll");
+//   auto enqueue = (fMedleyAPI_Enqueue)GetProcAddress(hMedley, "MedleyAPI_Enqueue");
+//   if (enqueue) enqueue("Slumber of Silisia", mobID, MEDLEY_PRIORITY_HIGH, 6000, false);
+//
+// Everything must be called from the game thread (OnPulse, commands, ...).  Callbacks are also
+// called from the game thread, during MQ2Medley's OnPulse.  Unsubscribe before your plugin unloads.
+
+#pragma once
+
+#include <cstdint>
+
+#define MEDLEY_API_VERSION       2
+#define MEDLEY_API_NAME_LEN      64
+
+// SongInfo.type
+#define MEDLEY_SONG_NONE         0
+#define MEDLEY_SONG_GEM          1
+#define MEDLEY_SONG_ITEM         2
+#define MEDLEY_SONG_AA           3
+
+// MedleyAPI_Enqueue priority classes, any int works, higher is cast first
+#define MEDLEY_PRIORITY_LOW      0
+#define MEDLEY_PRIORITY_NORMAL   1
+#define MEDLEY_PRIORITY_HIGH     2
+
+// MedleyAPI_Enqueue ttlMs, anything else is ms the song may wait before it is dropped
+#define MEDLEY_TTL_DEFAULT       0            // use QueueTTL from the ini
+#define MEDLEY_TTL_NONE          0xFFFFFFFFu  // never dropped, even if QueueTTL is set
+
+// callback events
+#define MEDLEY_EVENT_CAST_START     1   // a song was sent to the game
+#define MEDLEY_EVENT_CAST_COMPLETE  2   // a song finished without interruption
+#define MEDLEY_EVENT_INTERRUPT      3   // a song was interrupted or could not be cast
+
+struct MedleySongInfo
+{
+	char name[MEDLEY_API_NAME_LEN];
+	int type;                   // MEDLEY_SONG_*
+	uint32_t targetID;          // SpawnID the song is cast on, 0 for our target
+	uint32_t castTimeMs;
+	int64_t expiresInMs;        // ms until the song wears off, 0 if it is down or unknown
+	int once;                   // 1 if queued to cast once
+};
+
+struct MedleyStatus
+{
+	uint32_t size;              // set to sizeof(MedleyStatus) before calling
+	int active;                 // 1 if the medley is playing
+	char state[MEDLEY_API_NAME_LEN];     // scheduler state, same as ${Medley.State}
+	char medley[MEDLEY_API_NAME_LEN];    // current medley name
+	MedleySongInfo current;     // song being cast, type MEDLEY_SONG_NONE if none
+	MedleySongInfo next;        // best guess at the next song, type MEDLEY_SONG_NONE if none
+	int64_t ttqeMs;             // ms until the once queue is empty, 0 if nothing is queued
+	int queueLength;            // songs waiting in the once queue
+};
+
+typedef void (*fMedleyCallback)(int event, const MedleySongInfo* song, void* context);
+
+typedef int (*fMedleyAPI_Version)();
+typedef bool (*fMedleyAPI_Enqueue)(const char* name, uint32_t targetID, int priority, uint32_t ttlMs, bool interrupt);
+typedef bool (*fMedleyAPI_GetStatus)(MedleyStatus* status);
+typedef int (*fMedleyAPI_GetExpiries)(MedleySongInfo* songs, int maxSongs);
+typedef int64_t (*fMedleyAPI_GetSongExpiresMs)(const char* name);
+typedef int64_t (*fMedleyAPI_GetTTQEMs)();
+typedef int (*fMedleyAPI_Subscribe)(fMedleyCallback callback, void* context);
+typedef void (*fMedleyAPI_Unsubscribe)(int subscription);